@@ -0,0 +1,311 @@
+#ifndef H_ARCHIVE
+#define H_ARCHIVE
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include "mapped_file.hpp"
+#include "parallel.hpp"
+#include "sequence.hpp"
+
+// Compressed archive of a Raw_Sequence
+//
+// The elements of the top level vector (records) are split into blocks
+// that are encoded and decoded independently. Each block is stored by
+// columns, level by level in breadth-first order:
+//   records, levels                              varints
+//   per level: nodes, bit width, node codes      codes bit-packed
+//   leaves, leaf deltas                          zig-zag varints
+// A node code is 0 for a number and n+1 for a vector of n elements.
+// The leaves are delta encoded against the previous leaf of the block.
+//
+// After the blocks comes an index of block offsets and a footer:
+//   magic "NTDA", version, root is a vector, blocks, index offset.
+namespace archive {
+  constexpr char magic[4] {'N','T','D','A'};
+  constexpr std::uint32_t version {1};
+
+  struct footer {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t root_is_vec;
+    std::uint32_t reserved;
+    std::uint64_t blocks;
+    std::uint64_t index_offset;
+  };
+  static_assert(sizeof(footer) == 32);
+
+  [[noreturn]] inline void corrupt() {
+    throw std::runtime_error("archive: truncated or corrupt block");
+  }
+
+  inline std::uint32_t zigzag(int x) {
+    return (std::uint32_t(x) << 1) ^ std::uint32_t(x >> 31);
+  }
+  inline int unzigzag(std::uint32_t x) {
+    return int(x >> 1) ^ -int(x & 1);
+  }
+
+  inline void put_varint(std::string& out, std::uint64_t x) {
+    while (x >= 0x80) {
+      out.push_back(char(x | 0x80));
+      x >>= 7;
+    }
+    out.push_back(char(x));
+  }
+
+  // Bounds checked reading of an encoded block
+  struct reader {
+    const unsigned char* p;
+    const unsigned char* last;
+
+    std::uint64_t varint() {
+      std::uint64_t x{0};
+      for (int shift{0}; shift < 64; shift += 7) {
+        if (p == last) corrupt();
+        unsigned char c = *p++;
+        x |= std::uint64_t(c & 0x7f) << shift;
+        if (!(c & 0x80)) return x;
+      }
+      corrupt();
+    }
+    unsigned char byte() {
+      if (p == last) corrupt();
+      return *p++;
+    }
+    // A count of nodes still to be read. Every node takes at least one
+    // bit of the block, a code or a leaf, so a count that could not fit
+    // in what is left is rejected before anything is allocated for it.
+    std::uint64_t count() { return fits(varint()); }
+    std::uint64_t fits(std::uint64_t nodes) const {
+      if (nodes / 8 > std::uint64_t(last - p)) corrupt();
+      return nodes;
+    }
+  };
+
+  inline int bit_width(std::uint32_t max) {
+    int w{0};
+    while (w < 32 && (max >> w)) ++w;
+    return w;
+  }
+
+  inline void put_packed(std::string& out, const std::vector<std::uint32_t>& codes, int width) {
+    std::uint64_t acc{0};
+    int bits{0};
+    for (auto c : codes) {
+      acc |= std::uint64_t(c) << bits;
+      bits += width;
+      while (bits >= 8) {
+        out.push_back(char(acc));
+        acc >>= 8;
+        bits -= 8;
+      }
+    }
+    if (bits > 0) out.push_back(char(acc));
+  }
+
+  inline void get_packed(reader& in, std::vector<std::uint32_t>& codes, std::size_t n, int width) {
+    std::uint64_t bytes = (std::uint64_t(n) * width + 7) / 8;
+    if (std::uint64_t(in.last - in.p) < bytes) corrupt();
+    codes.resize(n);
+    std::uint64_t acc{0};
+    int bits{0};
+    const std::uint64_t mask = (std::uint64_t(1) << width) - 1;
+    for (auto& c : codes) {
+      while (bits < width) {
+        acc |= std::uint64_t(*in.p++) << bits;
+        bits += 8;
+      }
+      c = std::uint32_t(acc & mask);
+      acc >>= width;
+      bits -= width;
+    }
+  }
+
+  // Encode records [first, last) of the top level vector
+  inline std::string encode_block(const vec& records, std::size_t first, std::size_t last) {
+    std::string out;
+    std::vector<const Raw_Sequence*> level, next;
+    std::vector<std::uint32_t> codes;
+    std::vector<int> leaves;
+    for (std::size_t i{first}; i < last; ++i)
+      level.push_back(&records[i].data);
+
+    std::string levels;
+    std::uint64_t n_levels{0};
+    while (!level.empty()) {
+      codes.clear();
+      next.clear();
+      std::uint32_t max{0};
+      for (const auto* s : level) {
+        std::uint32_t code{0};
+        if (std::holds_alternative<int>(*s)) {
+          leaves.push_back(std::get<int>(*s));
+        } else {
+          const auto& v = std::get<vec>(*s);
+          code = v.size() + 1;
+          for (const auto& x : v) next.push_back(&x.data);
+        }
+        codes.push_back(code);
+        max = std::max(max, code);
+      }
+      int width = bit_width(max);
+      put_varint(levels, codes.size());
+      levels.push_back(char(width));
+      put_packed(levels, codes, width);
+      ++n_levels;
+      std::swap(level, next);
+    }
+
+    put_varint(out, last - first);
+    put_varint(out, n_levels);
+    out += levels;
+    put_varint(out, leaves.size());
+    int previous{0};
+    for (int x : leaves) {
+      put_varint(out, zigzag(int(std::uint32_t(x) - std::uint32_t(previous))));
+      previous = x;
+    }
+    return out;
+  }
+
+  // Decode one block into its records
+  inline vec decode_block(reader in) {
+    vec records (in.count());
+    std::uint64_t n_levels = in.varint();
+
+    // Slots to fill on the current level, in breadth-first order
+    std::vector<impl::wrapper*> slots, next;
+    std::vector<std::uint32_t> codes;
+    for (auto& r : records) slots.push_back(&r);
+
+    // Leaves come after all the levels, so shape the tree first and
+    // remember which slots take a number.
+    std::vector<impl::wrapper*> leaf_slots;
+    for (std::uint64_t l{0}; l < n_levels; ++l) {
+      std::uint64_t n = in.varint();
+      int width = in.byte();
+      if (n != slots.size() || width > 32) corrupt();
+      get_packed(in, codes, n, width);
+      std::uint64_t children {0};
+      for (auto c : codes)
+        if (c > 0) children += c - 1;
+      in.fits(children);
+      next.clear();
+      for (std::size_t i{0}; i < n; ++i) {
+        if (codes[i] == 0) {
+          leaf_slots.push_back(slots[i]);
+        } else {
+          slots[i]->data = vec(codes[i] - 1);
+          for (auto& x : std::get<vec>(slots[i]->data)) next.push_back(&x);
+        }
+      }
+      std::swap(slots, next);
+    }
+    if (!slots.empty()) corrupt();
+
+    if (in.varint() != leaf_slots.size()) corrupt();
+    int previous{0};
+    for (auto* slot : leaf_slots) {
+      previous = int(std::uint32_t(previous) + std::uint32_t(unzigzag(in.varint())));
+      slot->data = previous;
+    }
+    return records;
+  }
+}
+
+// Write s to path, with about block_leaves numbers per block
+void save_archive(const Raw_Sequence& s, const std::string& path,
+                  std::size_t block_leaves = 1 << 16) {
+  using namespace archive;
+  // A lone number is stored as a one record block
+  vec single;
+  const bool root_is_vec = std::holds_alternative<vec>(s);
+  if (!root_is_vec) single.emplace_back(std::get<int>(s));
+  const vec& records = root_is_vec ? std::get<vec>(s) : single;
+
+  std::vector<std::size_t> bounds {0};
+  std::size_t leaves{0};
+  for (std::size_t i{0}; i < records.size(); ++i) {
+    leaves += impl::count_leaves(records[i].data);
+    if (leaves >= block_leaves || i+1 == records.size()) {
+      bounds.push_back(i+1);
+      leaves = 0;
+    }
+  }
+
+  const std::size_t n_blocks = bounds.size() - 1;
+  std::vector<std::string> blocks (n_blocks);
+  parallel_for(n_blocks, [&](std::size_t b) {
+    blocks[b] = encode_block(records, bounds[b], bounds[b+1]);
+  });
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) throw std::runtime_error(path + ": cannot open for writing");
+  std::vector<std::uint64_t> index;
+  std::uint64_t offset{0};
+  for (const auto& b : blocks) {
+    index.push_back(offset);
+    out.write(b.data(), b.size());
+    offset += b.size();
+  }
+  index.push_back(offset);
+  out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(std::uint64_t));
+
+  footer f {};
+  std::copy(std::begin(magic), std::end(magic), f.magic);
+  f.version = version;
+  f.root_is_vec = root_is_vec;
+  f.blocks = n_blocks;
+  f.index_offset = offset;
+  out.write(reinterpret_cast<const char*>(&f), sizeof f);
+  if (!out.flush()) throw std::runtime_error(path + ": write failed");
+}
+
+// Read an archive, decoding its blocks in parallel
+Raw_Sequence load_archive(const std::string& path, unsigned threads = 0) {
+  using namespace archive;
+  mapped_file file(path);
+  footer f;
+  if (file.size < sizeof f) throw std::runtime_error(path + ": not an archive");
+  std::memcpy(&f, file.data + file.size - sizeof f, sizeof f);
+  if (!std::equal(std::begin(magic), std::end(magic), f.magic))
+    throw std::runtime_error(path + ": not an archive");
+  if (f.version != version)
+    throw std::runtime_error(path + ": unsupported version");
+  if (f.blocks >= (file.size - sizeof f) / sizeof(std::uint64_t))
+    corrupt();
+  const std::uint64_t index_bytes = (f.blocks + 1) * sizeof(std::uint64_t);
+  if (f.index_offset > file.size - sizeof f
+      || index_bytes != file.size - sizeof f - f.index_offset)
+    corrupt();
+
+  std::vector<std::uint64_t> index (f.blocks + 1);
+  std::memcpy(index.data(), file.data + f.index_offset, index_bytes);
+  const auto* base = reinterpret_cast<const unsigned char*>(file.data);
+  for (std::size_t b{0}; b < f.blocks; ++b)
+    if (index[b] > index[b+1] || index[b+1] > f.index_offset) corrupt();
+
+  std::vector<vec> blocks (f.blocks);
+  parallel_for(f.blocks, [&](std::size_t b) {
+    blocks[b] = decode_block(reader{base + index[b], base + index[b+1]});
+  }, threads);
+
+  if (!f.root_is_vec) {
+    if (blocks.size() != 1 || blocks[0].size() != 1
+        || !std::holds_alternative<int>(blocks[0][0].data))
+      corrupt();
+    return blocks[0][0].data;
+  }
+
+  vec records;
+  std::size_t n{0};
+  for (const auto& b : blocks) n += b.size();
+  records.reserve(n);
+  for (auto& b : blocks)
+    std::move(b.begin(), b.end(), std::back_inserter(records));
+  return records;
+}
+
+#endif
@@ -0,0 +1,409 @@
+// Benchmarks for the NTD stages, written as JSON to stdout.
+//
+//   g++ -O2 -std=c++17 bench.cpp -pthread -o bench
+//   ./bench [--min-time seconds] [--filter text] [--perf]
+//
+// Each result gives the time and heap bytes allocated per call and per
+// output element, and the peak resident set size of the process so far.
+// With --perf, hardware counters per element are added; counters that
+// cannot be opened are reported as null.
+// Build with -DNTD_COUNTERS to add the hot path counters per call.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include "perf_counters.hpp"
+#include "sequence.hpp"
+#include "fixed_sequence.hpp"
+#include "generator.hpp"
+#include "huge_pages.hpp"
+#include "persistent_sequence.hpp"
+#include "shared_sequence.hpp"
+#include "out_of_core.hpp"
+#include "raw_index.hpp"
+
+namespace bench {
+  std::atomic<std::size_t> bytes_allocated {0};
+}
+
+// Every replaced new has a matching delete, which is kept out of line:
+// inlined into a caller, the free in it would be matched against the
+// new of that caller's allocation rather than against this one.
+void* operator new(std::size_t n) {
+  bench::bytes_allocated.fetch_add(n, std::memory_order_relaxed);
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+void* operator new(std::size_t n, std::align_val_t a) {
+  bench::bytes_allocated.fetch_add(n, std::memory_order_relaxed);
+  // aligned_alloc takes a whole number of alignments
+  const std::size_t align = static_cast<std::size_t>(a);
+  if (void* p = std::aligned_alloc(align, (std::max<std::size_t>(n, 1) + align - 1) / align * align))
+    return p;
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+namespace bench {
+  // Shape of the generated inputs
+  struct shape {
+    int rank;
+    int width;
+    double ragged;       // chance a vector is shorter than width
+    double scalars;      // chance an element below the top is a number
+  };
+
+  Raw_Sequence make_input(const shape& sh, std::mt19937& gen, int order = 1) {
+    std::uniform_real_distribution<double> chance (0, 1);
+    std::uniform_int_distribution<int> value (-100, 100);
+    if (order > sh.rank || (order > 1 && chance(gen) < sh.scalars))
+      return value(gen);
+    int n = sh.width;
+    if (chance(gen) < sh.ragged)
+      n = std::uniform_int_distribution<int>(1, sh.width)(gen);
+    vec v;
+    v.reserve(n);
+    for (int i{0}; i < n; ++i)
+      v.emplace_back(make_input(sh, gen, order+1));
+    return v;
+  }
+
+  struct result {
+    double ns_per_call;
+    double bytes_per_call;
+    std::size_t calls;
+  };
+
+  volatile long sink;
+
+  // Call f until min_time has passed, after one warm up call
+  template <typename F>
+  result measure(double min_time, perf_counters* perf, F&& f) {
+    using clock = std::chrono::steady_clock;
+    sink = sink + f();
+    if (perf) perf->start();
+    std::size_t calls{0};
+    std::size_t bytes_before = bytes_allocated;
+    auto start = clock::now();
+    double elapsed{0};
+    do {
+      for (int i{0}; i < 8; ++i, ++calls)
+        sink = sink + f();
+      elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < min_time);
+    if (perf) perf->stop();
+    return { elapsed * 1e9 / calls, double(bytes_allocated - bytes_before) / calls, calls };
+  }
+
+  long peak_rss_bytes() {
+    rusage u;
+    getrusage(RUSAGE_SELF, &u);
+    return u.ru_maxrss * 1024L;
+  }
+
+  struct runner {
+    double min_time {0.1};
+    std::string filter;
+    std::unique_ptr<perf_counters> perf;
+    bool first {true};
+
+    template <typename F>
+    void run(const std::string& name, const shape& sh, std::size_t elements, F&& f) {
+      if (!filter.empty() && name.find(filter) == std::string::npos) return;
+      counters::reset();
+      result r = measure(min_time, perf.get(), f);
+      std::cout << (first ? "\n" : ",\n");
+      first = false;
+      std::cout << "    {\"name\": \"" << name << "\""
+                << ", \"rank\": " << sh.rank
+                << ", \"width\": " << sh.width
+                << ", \"ragged\": " << sh.ragged
+                << ", \"scalars\": " << sh.scalars
+                << ", \"elements\": " << elements
+                << ", \"ns_per_call\": " << r.ns_per_call
+                << ", \"ns_per_element\": " << r.ns_per_call / elements
+                << ", \"bytes_per_call\": " << r.bytes_per_call
+                << ", \"bytes_per_element\": " << r.bytes_per_call / elements
+                << ", \"peak_rss_bytes\": " << peak_rss_bytes();
+      if (perf) {
+        std::cout << ", \"perf\": {";
+        for (int c{0}; c < perf_counters::counter_count; ++c) {
+          double v = perf->read(perf_counters::counter(c));
+          std::cout << (c ? ", " : "") << "\"" << perf_counters::names[c] << "_per_element\": ";
+          if (v < 0) std::cout << "null";
+          else std::cout << v / r.calls / elements;
+        }
+        std::cout << "}";
+      }
+#ifdef NTD_COUNTERS
+      // Counters per call, including the warm up call
+      auto c = counters::snapshot();
+      const double calls = r.calls + 1;
+      std::cout << ", \"counters\": {"
+                << "\"nodes_visited\": " << c.nodes_visited / calls
+                << ", \"variant_dispatches\": " << c.variant_dispatches / calls
+                << ", \"elements_repeated\": " << c.elements_repeated / calls
+                << ", \"elements_computed\": " << c.elements_computed / calls
+                << ", \"bytes_copied\": " << c.bytes_copied / calls
+                << ", \"allocations\": " << c.allocations / calls << "}";
+#endif
+      std::cout << "}";
+    }
+  };
+
+  std::size_t product(const std::vector<int>& lengths) {
+    return std::accumulate(lengths.begin(), lengths.end(), std::size_t(1),
+                           std::multiplies<std::size_t>());
+  }
+
+  // A block of a shape known at compile time, against the same block
+  // as a Sequence and a row broadcast over it
+  template <int... Extents>
+  void run_fixed(runner& r, const shape& sh) {
+    Fixed_Sequence<int, Extents...> a;
+    Fixed_Sequence<int, 1, Extents...> b;
+    std::iota(a.data.begin(), a.data.end(), 0);
+    std::iota(b.data.begin(), b.data.end(), 0);
+    Sequence sa = a.sequence(), sb = b.sequence();
+    r.run("transpose_distribute_fixed", sh, a.size, [&] {
+      a.data[0] = int(sink);
+      return transpose_distribute(a, b, std::plus<int>()).data[std::size_t(sink) % a.size];
+    });
+    r.run("transpose_distribute_fixed_as_sequence", sh, a.size, [&] {
+      return transpose_distribute(sa, sb, std::plus<int>()).data.back();
+    });
+  }
+
+  // Many tiny ragged records, as one table and one call per record.
+  // Same shape records all have the same nodes.
+  void run_table(runner& r, bool same_shape) {
+    const std::string name = same_shape ? "table_same_shape" : "table";
+    if (!r.filter.empty() && (name + "_transpose_distribute_per_record").find(r.filter)
+                             == std::string::npos)
+      return;
+    generator_options opt;
+    opt.leaves = 1 << 18;
+    opt.max_fan_out = 4;
+    if (same_shape) {
+      opt.min_fan_out = opt.max_fan_out;
+      opt.number_chance = {0.0};
+    }
+    auto x = generate_table(opt);
+    opt.seed = 1;
+    auto y = generate_table(opt);
+    Sequence_Table a, b;
+    std::vector<Raw_Sequence> raw_a, raw_b;
+    for (std::size_t i{0}; i < std::min(x.size(), y.size()); ++i) {
+      a.push_back(x.record(i));
+      b.push_back(y.record(i));
+      raw_a.push_back(to_raw(x.record(i)));
+      raw_b.push_back(to_raw(y.record(i)));
+    }
+    const shape sh {opt.depth + 1, opt.max_fan_out, same_shape ? 0.0 : 1.0,
+                    opt.number_chance.back()};
+    const std::size_t elements = transpose_distribute(a, b, std::plus<int>()).data.size();
+    r.run(name + "_transpose_distribute", sh, elements, [&] {
+      return transpose_distribute(a, b, std::plus<int>()).data.size();
+    });
+    r.run(name + "_transpose_distribute_per_record", sh, elements, [&] {
+      std::size_t n{0};
+      for (std::size_t i{0}; i < raw_a.size(); ++i)
+        n += transpose_distribute(raw_a[i], raw_b[i], std::plus<int>()).data.size();
+      return n;
+    });
+  }
+
+  // Two 64 MiB Sequences of the same lengths, with the result on the
+  // heap and on huge pages, both on one thread so only the pages
+  // differ. Huge page buffers are mapped directly, so they do not show
+  // in bytes_per_call.
+  void run_large(runner& r) {
+    if (!r.filter.empty() && std::string("transpose_distribute_large_huge_pages").find(r.filter)
+                             == std::string::npos)
+      return;
+    const int n = 1 << 24;
+    const shape sh {1, n, 0, 0};
+    Sequence a (std::vector<int>(n, 1), {n}), b (std::vector<int>(n, 2), {n});
+    r.run("transpose_distribute_large", sh, n, [&] {
+      return transpose_distribute(a, b, std::plus<int>()).data.size();
+    });
+    r.run("transpose_distribute_large_huge_pages", sh, n, [&] {
+      return transpose_distribute(a, b, std::plus<int>(), huge_page_allocator<int>(), 1).data.size();
+    });
+  }
+
+  void run_all(runner& r) {
+    const std::vector<std::pair<int, std::vector<int>>> sizes {
+      {1, {16, 1024, 65536}},
+      {2, {4, 32, 256}},
+      {3, {4, 16, 64}},
+    };
+    for (const auto& [rank, widths] : sizes)
+    for (int width : widths)
+    for (double ragged : {0.0, 0.5})
+    for (double scalars : {0.0, 0.25}) {
+      if (rank == 1 && scalars > 0) continue;
+      shape sh {rank, width, ragged, scalars};
+      std::mt19937 gen (rank * 1000003 + width);
+      Raw_Sequence a = make_input(sh, gen);
+      Raw_Sequence b = make_input(sh, gen);
+      Raw_Sequence c = make_input(sh, gen);
+      auto lengths = get_lengths({a, b});
+      const std::size_t elements = product(lengths);
+
+      r.run("get_lengths", sh, elements, [&] {
+        return get_lengths(a).size();
+      });
+      r.run("get_lengths_multiple", sh, elements, [&] {
+        return get_lengths({a, b, c}).size();
+      });
+
+      // Append a record and get the new lengths: a copy of the whole
+      // tree for a Raw_Sequence, one new root for a Persistent_Sequence
+      if (const vec* v = std::get_if<vec>(&a); v && !v->empty()) {
+        const Raw_Sequence record = v->front().data;
+        r.run("edit_get_lengths_raw", sh, elements, [&] {
+          Raw_Sequence edited = a;
+          std::get<vec>(edited).push_back(record);
+          return get_lengths(edited).size();
+        });
+        Persistent_Sequence p (a);
+        const Persistent_Sequence p_record = p[0];
+        r.run("edit_get_lengths_persistent", sh, elements, [&] {
+          return get_lengths(p.push_back({}, p_record)).size();
+        });
+      }
+      r.run("normalise_raw", sh, elements, [&] {
+        return normalise(a, lengths).data.size();
+      });
+      r.run("normalise_raw_unchecked", sh, elements, [&] {
+        return normalise<unchecked>(a, lengths).data.size();
+      });
+
+      // A Sequence with the last length halved, normalised back up
+      auto small_lengths = lengths;
+      small_lengths.back() = std::max(1, small_lengths.back() / 2);
+      Sequence small (std::vector<int>(product(small_lengths), 1), small_lengths);
+      r.run("normalise_sequence", sh, elements, [&] {
+        return normalise(small, lengths).data.size();
+      });
+      r.run("normalise_sequence_unchecked", sh, elements, [&] {
+        return normalise<unchecked>(small, lengths).data.size();
+      });
+
+      // Normalising to the lengths it already has: a copy of the
+      // elements for a Sequence, none for a Shared_Sequence
+      Sequence full (std::vector<int>(elements, 1), lengths);
+      Shared_Sequence shared = share(full);
+      r.run("normalise_sequence_same_lengths", sh, elements, [&] {
+        return normalise(full, lengths).data.size();
+      });
+      r.run("normalise_shared_same_lengths", sh, elements, [&] {
+        return normalise(shared, lengths).data.size();
+      });
+
+      r.run("transpose_distribute", sh, elements, [&] {
+        return transpose_distribute(a, b, std::plus<int>()).data.size();
+      });
+      r.run("transpose_distribute_unchecked", sh, elements, [&] {
+        return transpose_distribute<unchecked>(a, b, std::plus<int>()).data.size();
+      });
+
+      // A costly func. transpose_distribute_unique is ahead where
+      // numbers above the last level or ragged vectors repeat pairs,
+      // by up to a third at scalars 0.25. With every pair distinct it
+      // hands over to transpose_distribute after a walk of the
+      // operands, a few percent behind, and on outputs of tens of
+      // elements building the Raw_Index costs more than func does.
+      auto expensive = [](int x, int y) {
+        return int(1000 * std::sin(x * 0.1) * std::cos(y * 0.1) + std::log1p(x * x + y * y));
+      };
+      r.run("transpose_distribute_expensive", sh, elements, [&] {
+        return transpose_distribute(a, b, expensive).data.size();
+      });
+      r.run("transpose_distribute_unique_expensive", sh, elements, [&] {
+        return transpose_distribute_unique(a, b, expensive).data.size();
+      });
+
+      // 1024 elements sampled through an index, against normalising
+      {
+        Raw_Index index (a);
+        std::vector<std::vector<int>> samples (1024, std::vector<int>(lengths.size()));
+        for (auto& i : samples)
+          for (std::size_t order{0}; order < i.size(); ++order)
+            i[order] = std::uniform_int_distribution<int>(0, lengths[order] - 1)(gen);
+        r.run("raw_index_sample_1024", sh, samples.size(), [&] {
+          long total {0};
+          for (const auto& i : samples) total += index.at(i);
+          return total;
+        });
+      }
+
+      // Chunks of 4096 elements to a sink that only adds them up
+      r.run("transpose_distribute_out_of_core", sh, elements, [&] {
+        long total {0};
+        out_of_core::transpose_distribute(a, b, std::plus<int>(), lengths,
+            [&](const int* data, std::size_t n) { total += std::accumulate(data, data + n, 0L); },
+            4096);
+        return total;
+      });
+
+      // Buffers from a pool kept across calls, so the heap is only
+      // touched while the pool grows
+      std::pmr::unsynchronized_pool_resource pool;
+      r.run("transpose_distribute_pool", sh, elements, [&] {
+        std::pmr::polymorphic_allocator<int> alloc {&pool};
+        return transpose_distribute(a, b, std::plus<int>(), alloc).data.size();
+      });
+
+      if (ragged == 0 && scalars == 0) {
+        std::vector<int> half (elements / 2 + 1, 1);
+        r.run("repeat_elements", sh, elements, [&] {
+          auto v = half;
+          repeat_elements(v, elements);
+          return v.size();
+        });
+      }
+    }
+    run_fixed<3,4>(r, {2, 4, 0, 0});
+    run_fixed<4,4,4>(r, {3, 4, 0, 0});
+    run_table(r, false);
+    run_table(r, true);
+    run_large(r);
+  }
+}
+
+int main(int argc, char** argv) {
+  bench::runner r;
+  for (int i{1}; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--min-time" && i+1 < argc) r.min_time = std::atof(argv[++i]);
+    else if (arg == "--filter" && i+1 < argc) r.filter = argv[++i];
+    else if (arg == "--perf") {
+      r.perf = std::make_unique<perf_counters>();
+      if (!r.perf->any_available())
+        std::cerr << "warning: no hardware counters available\n";
+    }
+    else {
+      std::cerr << "usage: " << argv[0] << " [--min-time seconds] [--filter text] [--perf]\n";
+      return 1;
+    }
+  }
+  std::cout << "{\n  \"benchmarks\": [";
+  bench::run_all(r);
+  std::cout << "\n  ]\n}\n";
+}
@@ -0,0 +1,264 @@
+#ifndef H_CAPTURE
+#define H_CAPTURE
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include "archive.hpp"
+#include "mapped_file.hpp"
+#include "sequence.hpp"
+
+// Capture of the NTD calls a program makes, and replay of the log.
+//
+// Build with -DNTD_CAPTURE and call capture::start to record every
+// outermost normalise and transpose_distribute call. Each operand is
+// stored by its structure: the Ragged_Sequence nodes of a Raw_Sequence
+// or the lengths of a Sequence. The numbers themselves are only stored
+// when asked for; otherwise replay fills in made up numbers of the
+// same shape.
+//
+// Log layout: magic "NTDC", version, then per call
+//   call, operands                                      varints
+//   per operand: kind (0 raw, 1 sequence, 2 lengths)
+//     raw:       nodes, node codes, leaves, has data, data
+//     sequence:  lengths, lengths, size, has data, data
+//     lengths:   lengths, lengths
+// with signed values zig-zag encoded and data delta encoded.
+namespace capture {
+  constexpr char magic[4] {'N','T','D','C'};
+  constexpr std::uint32_t version {1};
+
+  enum operand_kind { raw_operand, sequence_operand, lengths_operand };
+
+  namespace detail {
+    struct log {
+      std::ofstream out;
+      bool with_data;
+      std::string buffer;
+    };
+
+    inline std::unique_ptr<log>& current() {
+      static std::unique_ptr<log> l;
+      return l;
+    }
+
+    inline std::mutex& current_mutex() {
+      static std::mutex m;
+      return m;
+    }
+
+    inline void put_ints(std::string& out, const int* first, std::size_t n, bool delta) {
+      int previous{0};
+      for (std::size_t i{0}; i < n; ++i) {
+        archive::put_varint(out, archive::zigzag(
+            int(std::uint32_t(first[i]) - std::uint32_t(previous))));
+        if (delta) previous = first[i];
+      }
+    }
+
+    inline void put_lengths(std::string& out, const int* lengths, std::size_t rank) {
+      archive::put_varint(out, rank);
+      put_ints(out, lengths, rank, false);
+    }
+
+    inline void record(call c, std::initializer_list<operand> operands) {
+      std::lock_guard<std::mutex> lock(current_mutex());
+      auto& l = current();
+      if (!l) return;
+      std::string& out = l->buffer;
+      out.clear();
+      archive::put_varint(out, c);
+      archive::put_varint(out, operands.size());
+      for (const auto& o : operands) {
+        if (o.raw) {
+          Ragged_Sequence r = flatten(*o.raw);
+          archive::put_varint(out, raw_operand);
+          archive::put_varint(out, r.nodes.size());
+          put_ints(out, r.nodes.data(), r.nodes.size(), false);
+          archive::put_varint(out, r.data.size());
+          out.push_back(l->with_data);
+          if (l->with_data) put_ints(out, r.data.data(), r.data.size(), true);
+        } else if (o.data) {
+          archive::put_varint(out, sequence_operand);
+          put_lengths(out, o.lengths, o.rank);
+          archive::put_varint(out, o.size);
+          out.push_back(l->with_data);
+          if (l->with_data) put_ints(out, o.data, o.size, true);
+        } else {
+          archive::put_varint(out, lengths_operand);
+          put_lengths(out, o.lengths, o.rank);
+        }
+      }
+      l->out.write(out.data(), out.size());
+    }
+  }
+
+  // Start capturing calls to a new log at path. When nothing is being
+  // captured a call only loads the recorder pointer.
+  inline void start(const std::string& path, bool with_data = false) {
+    auto l = std::make_unique<detail::log>();
+    l->out.open(path, std::ios::binary | std::ios::trunc);
+    if (!l->out) throw std::runtime_error(path + ": cannot open for writing");
+    l->with_data = with_data;
+    l->out.write(magic, 4);
+    l->out.write(reinterpret_cast<const char*>(&version), sizeof version);
+    std::lock_guard<std::mutex> lock(detail::current_mutex());
+    detail::current() = std::move(l);
+    recorder.store(&detail::record, std::memory_order_release);
+  }
+
+  inline void stop() {
+    recorder.store(nullptr, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(detail::current_mutex());
+    if (auto& l = detail::current()) {
+      l->out.flush();
+      l.reset();
+    }
+  }
+
+  // One operand of a logged call, rebuilt ready to run
+  struct captured_operand {
+    operand_kind kind;
+    Raw_Sequence raw;
+    Sequence sequence;
+    std::vector<int> lengths;
+  };
+
+  struct captured_call {
+    call kind;
+    std::vector<captured_operand> operands;
+  };
+
+  namespace detail {
+    inline int get_int(archive::reader& in) {
+      return archive::unzigzag(std::uint32_t(in.varint()));
+    }
+
+    // Read n numbers, or make some up for logs without data. n was
+    // checked against the structure of the operand, and logged numbers
+    // must also fit in what is left of the log.
+    inline std::vector<int> get_data(archive::reader& in, std::size_t n) {
+      const bool logged = in.byte();
+      if (logged) in.fits(n);
+      std::vector<int> data (n);
+      if (logged) {
+        int previous{0};
+        for (auto& x : data)
+          x = previous = int(std::uint32_t(previous) + std::uint32_t(get_int(in)));
+      } else {
+        for (std::size_t i{0}; i < n; ++i) data[i] = int(i % 97) + 1;
+      }
+      return data;
+    }
+
+    inline std::vector<int> get_lengths(archive::reader& in) {
+      std::vector<int> lengths (in.count());
+      for (auto& x : lengths) x = get_int(in);
+      return lengths;
+    }
+
+    // Number of leaves of the Ragged_Sequence nodes, which must make
+    // one tree: no vector has more children than there are nodes left.
+    inline std::uint64_t leaves(const std::vector<int>& nodes) {
+      std::uint64_t pending {1}, leaves {0};
+      for (std::size_t i{0}; i < nodes.size(); ++i) {
+        if (pending == 0) archive::corrupt();
+        --pending;
+        if (nodes[i] < 0) ++leaves;
+        else pending += std::uint64_t(nodes[i]);
+        if (pending > nodes.size() - i - 1) archive::corrupt();
+      }
+      if (pending != 0) archive::corrupt();
+      return leaves;
+    }
+
+    // Number of elements of a Sequence with the lengths
+    inline std::uint64_t elements(const std::vector<int>& lengths, std::uint64_t size) {
+      std::uint64_t n {1};
+      for (int l : lengths) {
+        if (l < 0) archive::corrupt();
+        if (l != 0 && n > size / std::uint64_t(l)) archive::corrupt();
+        n *= std::uint64_t(l);
+      }
+      return n;
+    }
+
+    [[noreturn]] inline void mismatch() {
+      throw std::runtime_error("capture: operands do not match the call");
+    }
+
+    inline void expect(const captured_call& c, operand_kind first, operand_kind second) {
+      if (c.operands.size() != 2 || c.operands[0].kind != first || c.operands[1].kind != second)
+        mismatch();
+    }
+  }
+
+  inline std::vector<captured_call> read_log(const std::string& path) {
+    mapped_file file(path);
+    if (file.size < 8 || !std::equal(magic, magic + 4, file.data))
+      throw std::runtime_error(path + ": not a capture log");
+    std::uint32_t v;
+    std::memcpy(&v, file.data + 4, sizeof v);
+    if (v != version) throw std::runtime_error(path + ": unsupported version");
+
+    const auto* base = reinterpret_cast<const unsigned char*>(file.data);
+    archive::reader in {base + 8, base + file.size};
+    std::vector<captured_call> calls;
+    while (in.p != in.last) {
+      captured_call c;
+      c.kind = call(in.varint());
+      if (c.kind > transpose_distribute_sequence) archive::corrupt();
+      c.operands.resize(in.count());
+      for (auto& o : c.operands) {
+        o.kind = operand_kind(in.varint());
+        if (o.kind == raw_operand) {
+          Ragged_Sequence r;
+          r.nodes.resize(in.count());
+          for (auto& x : r.nodes) x = detail::get_int(in);
+          const std::uint64_t n = in.varint();
+          if (n != detail::leaves(r.nodes)) archive::corrupt();
+          r.data = detail::get_data(in, n);
+          o.raw = to_raw(r);
+        } else if (o.kind == sequence_operand) {
+          o.sequence.lengths = detail::get_lengths(in);
+          const std::uint64_t n = in.varint();
+          if (n != detail::elements(o.sequence.lengths, n)) archive::corrupt();
+          o.sequence.data = detail::get_data(in, n);
+        } else if (o.kind == lengths_operand) {
+          o.lengths = detail::get_lengths(in);
+        } else {
+          archive::corrupt();
+        }
+      }
+      calls.push_back(std::move(c));
+    }
+    return calls;
+  }
+
+  // Run a logged call again, with std::plus as the function of
+  // transpose_distribute. Returns the number of output elements. A call
+  // whose operands are not of the kinds it takes is a std::runtime_error.
+  inline std::size_t replay(const captured_call& c) {
+    const auto& o = c.operands;
+    switch (c.kind) {
+      case normalise_raw:
+        detail::expect(c, raw_operand, lengths_operand);
+        return normalise(o[0].raw, o[1].lengths).data.size();
+      case normalise_sequence:
+        detail::expect(c, sequence_operand, lengths_operand);
+        return normalise(o[0].sequence, o[1].lengths).data.size();
+      case transpose_distribute_raw:
+        detail::expect(c, raw_operand, raw_operand);
+        return transpose_distribute(o[0].raw, o[1].raw, std::plus<int>()).data.size();
+      case transpose_distribute_sequence:
+        detail::expect(c, sequence_operand, sequence_operand);
+        return transpose_distribute(o[0].sequence, o[1].sequence, std::plus<int>()).data.size();
+    }
+    detail::mismatch();
+  }
+}
+
+#endif
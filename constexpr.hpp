@@ -0,0 +1,14 @@
+#ifndef H_CONSTEXPR
+#define H_CONSTEXPR
+
+// constexpr where the NTD core can run in constant evaluation, which
+// needs the transient allocation of C++20
+#ifndef NTD_CONSTEXPR
+#if __cpp_constexpr_dynamic_alloc >= 201907L
+#define NTD_CONSTEXPR constexpr
+#else
+#define NTD_CONSTEXPR
+#endif
+#endif
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef H_COUNTERS
+#define H_COUNTERS
+
+#include <chrono>
+#include <cstdint>
+#include "constexpr.hpp"
+
+// Per-thread counters and stage timers for the NTD hot paths.
+//
+// Counting is switched on by compiling with -DNTD_COUNTERS. Without it
+// NTD_COUNT and NTD_TIME expand to nothing, so the hot paths are the
+// same as if they were never instrumented. snapshot() and reset() are
+// always available and return zeros when counting is off. Both macros
+// may be used in constexpr functions and do nothing at compile time.
+namespace counters {
+  enum stage {
+    get_lengths,
+    normalise_raw,
+    normalise_sequence,
+    transform,
+    stage_count
+  };
+
+  struct values {
+    std::uint64_t nodes_visited {0};
+    std::uint64_t variant_dispatches {0};
+    std::uint64_t elements_repeated {0};
+    std::uint64_t elements_computed {0};
+    std::uint64_t bytes_copied {0};
+    std::uint64_t allocations {0};
+    std::uint64_t calls[stage_count] {};
+    std::uint64_t ns[stage_count] {};
+  };
+
+  inline values& local() {
+    thread_local values v;
+    return v;
+  }
+
+  // Counters of the calling thread
+  inline values snapshot() { return local(); }
+  inline void reset() { local() = values{}; }
+
+  // Adds the time until the end of its scope to stage s. Only the
+  // outermost timer of a stage counts, so stages that call themselves
+  // are not counted twice.
+  // Nothing is timed during constant evaluation.
+  class scoped_timer {
+    using clock = std::chrono::steady_clock;
+    stage s;
+    clock::time_point start;
+
+    static int& depth(stage s) {
+      thread_local int d[stage_count] {};
+      return d[s];
+    }
+  public:
+    constexpr explicit scoped_timer(stage _s) : s(_s), start() {
+      if (__builtin_is_constant_evaluated()) return;
+      if (depth(s)++ == 0) start = clock::now();
+    }
+    scoped_timer(const scoped_timer&) = delete;
+    NTD_CONSTEXPR ~scoped_timer() {
+#if __cpp_constexpr_dynamic_alloc >= 201907L
+      if (__builtin_is_constant_evaluated()) return;
+#endif
+      if (--depth(s) == 0) {
+        local().calls[s] += 1;
+        local().ns[s] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            clock::now() - start).count();
+      }
+    }
+  };
+}
+
+#define NTD_CONCAT_(a, b) a##b
+#define NTD_CONCAT(a, b) NTD_CONCAT_(a, b)
+
+#ifdef NTD_COUNTERS
+#define NTD_COUNT(counter, n) \
+  (__builtin_is_constant_evaluated() ? void() : void(counters::local().counter += (n)))
+#define NTD_TIME(s) counters::scoped_timer NTD_CONCAT(ntd_timer_, __LINE__) {counters::s}
+#else
+#define NTD_COUNT(counter, n) ((void)0)
+#define NTD_TIME(s) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef H_FIXED_SEQUENCE
+#define H_FIXED_SEQUENCE
+
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "sequence.hpp"
+
+// Sequences with lengths known at compile time, such as 3x4 or 4x4x4
+// blocks. The elements live in a std::array, and normalise and
+// transpose_distribute work out the result lengths at compile time
+// and unroll the loop over the elements, so nothing is allocated.
+//
+// The lengths are broadcast as for Sequence: the result has the
+// largest length at each level, an operand of lower rank gets leading
+// lengths of 1, and a level shorter than the result repeats its
+// elements, so index i at that level reads element i mod length.
+template <typename T, int... Extents>
+struct Fixed_Sequence {
+  static_assert(((Extents > 0) && ...), "Fixed_Sequence: lengths must be positive");
+  using value_type = T;
+  static constexpr std::size_t rank = sizeof...(Extents);
+  static constexpr std::size_t size = (std::size_t(1) * ... * std::size_t(Extents));
+  static constexpr std::array<int, rank> lengths {Extents...};
+
+  std::array<T, size> data;
+
+  // Copy into a dynamic Sequence
+  Basic_Sequence<std::vector<T>> sequence() const {
+    return {{data.begin(), data.end()}, {lengths.begin(), lengths.end()}};
+  }
+};
+
+namespace fixed {
+  // Loops over at most this many elements are unrolled
+  constexpr std::size_t unroll_limit {256};
+
+  template <std::size_t N, std::size_t M>
+  constexpr std::array<int, (N > M ? N : M)> broadcast_lengths(
+      const std::array<int, N>& a, const std::array<int, M>& b) {
+    std::array<int, (N > M ? N : M)> lengths {};
+    for (std::size_t i{0}; i < lengths.size(); ++i)
+      lengths[i] = std::max(i < N ? a[i] : 0, i < M ? b[i] : 0);
+    return lengths;
+  }
+
+  // Whether from, with leading lengths of 1, broadcasts to to
+  template <std::size_t N, std::size_t M>
+  constexpr bool fits(const std::array<int, N>& from, const std::array<int, M>& to) {
+    if (N > M) return false;
+    for (std::size_t d{0}; d < N; ++d)
+      if (from[d] > to[d + M - N]) return false;
+    return true;
+  }
+
+  // Index into the elements of from of element i once broadcast to to
+  template <std::size_t N, std::size_t M>
+  constexpr std::size_t source_index(
+      const std::array<int, N>& from, const std::array<int, M>& to, std::size_t i) {
+    std::size_t index{0}, stride{1};
+    for (std::size_t d{M}; d-- > 0;) {
+      const std::size_t to_length = to[d];
+      const std::size_t from_length = d + N >= M ? from[d + N - M] : 1;
+      index += (i % to_length % from_length) * stride;
+      stride *= from_length;
+      i /= to_length;
+    }
+    return index;
+  }
+
+  template <typename From, typename To, std::size_t... I>
+  constexpr std::array<std::size_t, sizeof...(I)> make_indices(std::index_sequence<I...>) {
+    return {source_index(From::lengths, To::lengths, I)...};
+  }
+
+  template <typename From, typename To>
+  inline constexpr auto indices = make_indices<From, To>(std::make_index_sequence<To::size>{});
+
+  template <typename T, const auto& Lengths, std::size_t... I>
+  Fixed_Sequence<T, Lengths[I]...> sequence_type(std::index_sequence<I...>);
+
+  // Fixed_Sequence of T with the broadcast lengths of A and B
+  template <typename T, typename A, typename B>
+  struct broadcast {
+    static constexpr auto lengths = broadcast_lengths(A::lengths, B::lengths);
+    using type = decltype(sequence_type<T, lengths>(
+        std::make_index_sequence<lengths.size()>{}));
+  };
+
+  template <typename R, typename A, typename B, typename TF, std::size_t... I>
+  constexpr void transform_unrolled(R& r, const A& a, const B& b, TF& func,
+                                    std::index_sequence<I...>) {
+    constexpr auto& ia = indices<A, R>;
+    constexpr auto& ib = indices<B, R>;
+    ((r.data[I] = func(a.data[ia[I]], b.data[ib[I]])), ...);
+  }
+
+  template <typename R, typename A, typename B, typename TF>
+  constexpr void transform(R& r, const A& a, const B& b, TF& func) {
+    if constexpr (R::size <= unroll_limit) {
+      transform_unrolled(r, a, b, func, std::make_index_sequence<R::size>{});
+    } else {
+      constexpr auto& ia = indices<A, R>;
+      constexpr auto& ib = indices<B, R>;
+      for (std::size_t i{0}; i < R::size; ++i)
+        r.data[i] = func(a.data[ia[i]], b.data[ib[i]]);
+    }
+  }
+}
+
+// Fixed_Sequence with the elements of s, which must have the same lengths
+template <typename T, int... Extents, typename Container>
+Fixed_Sequence<T, Extents...> to_fixed(const Basic_Sequence<Container>& s) {
+  using result_type = Fixed_Sequence<T, Extents...>;
+  if (!std::equal(s.lengths.begin(), s.lengths.end(),
+                  result_type::lengths.begin(), result_type::lengths.end())
+      || s.data.size() != result_type::size)
+    throw std::invalid_argument("to_fixed: lengths do not match");
+  result_type r {};
+  std::copy(s.data.begin(), s.data.end(), r.data.begin());
+  return r;
+}
+
+template <int... To, typename T, int... Extents>
+constexpr Fixed_Sequence<T, To...> normalise(const Fixed_Sequence<T, Extents...>& s) {
+  using result_type = Fixed_Sequence<T, To...>;
+  using operand_type = Fixed_Sequence<T, Extents...>;
+  static_assert(fixed::fits(operand_type::lengths, result_type::lengths),
+                "normalise: lengths too small for the Fixed_Sequence");
+  constexpr auto& index = fixed::indices<operand_type, result_type>;
+  result_type r {};
+  for (std::size_t i{0}; i < result_type::size; ++i)
+    r.data[i] = s.data[index[i]];
+  return r;
+}
+
+template <typename Policy = default_policy, typename T, int... Extents>
+Sequence normalise(const Fixed_Sequence<T, Extents...>& s, std::vector<int> lengths) {
+  return normalise<Policy>(s.sequence(), std::move(lengths));
+}
+
+template <typename TA, int... EA, typename TB, int... EB, typename TF>
+constexpr auto transpose_distribute(
+    const Fixed_Sequence<TA, EA...>& a, const Fixed_Sequence<TB, EB...>& b, TF&& func) {
+  using A = Fixed_Sequence<TA, EA...>;
+  using B = Fixed_Sequence<TB, EB...>;
+  using T = std::decay_t<std::invoke_result_t<TF&, const TA&, const TB&>>;
+  using result_type = typename fixed::broadcast<T, A, B>::type;
+  static_assert(fixed::fits(A::lengths, result_type::lengths)
+                && fixed::fits(B::lengths, result_type::lengths),
+                "transpose_distribute: lengths do not broadcast");
+  result_type r {};
+  fixed::transform(r, a, b, func);
+  return r;
+}
+
+// Mixed with a dynamic Sequence, the fixed operand is copied into one
+template <typename Policy = default_policy, typename T, int... Extents, typename C, typename TF>
+Sequence transpose_distribute(
+    const Fixed_Sequence<T, Extents...>& a, const Basic_Sequence<C>& b, TF&& func) {
+  return transpose_distribute<Policy>(a.sequence(), b, std::forward<TF>(func));
+}
+
+template <typename Policy = default_policy, typename C, typename T, int... Extents, typename TF>
+Sequence transpose_distribute(
+    const Basic_Sequence<C>& a, const Fixed_Sequence<T, Extents...>& b, TF&& func) {
+  return transpose_distribute<Policy>(a, b.sequence(), std::forward<TF>(func));
+}
+
+template <typename T, int... Extents>
+std::ostream &operator<< (std::ostream &os, const Fixed_Sequence<T, Extents...>& s) {
+  return os << s.sequence();
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef H_GENERATOR
+#define H_GENERATOR
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include "parallel.hpp"
+#include "sequence.hpp"
+#include "sequence_table.hpp"
+
+// Seeded random ragged sequences for benchmarks and stress runs.
+//
+// The result is a vector of records. Every record is generated from
+// its own seed, derived from the options seed and the record index,
+// so records are made in parallel and the output only depends on the
+// options, never on the number of threads.
+struct generator_options {
+  std::uint64_t seed {0};
+  // Stop adding records once there are at least this many numbers
+  std::uint64_t leaves {1000};
+  // Levels of vectors below the top level vector. Elements deeper
+  // than this are always numbers.
+  int depth {2};
+  // Chance an element at level i (records are level 0) is a number
+  // rather than a vector. The last entry is used for deeper levels.
+  std::vector<double> number_chance {0.0, 0.25};
+  // Fan-out of each vector, uniform between min and max unless
+  // fan_out_weights is given, where entry i weighs fan-out min + i.
+  int min_fan_out {1};
+  int max_fan_out {8};
+  std::vector<double> fan_out_weights {};
+  int min_value {-1000};
+  int max_value {1000};
+};
+
+namespace generator {
+  // SplitMix64, a small fast generator that is cheap to seed per record
+  struct splitmix64 {
+    std::uint64_t state;
+
+    std::uint64_t next() {
+      std::uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+    }
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }
+    // Uniform in [0, n), n > 0
+    std::uint64_t below(std::uint64_t n) {
+      return (unsigned __int128)(next()) * n >> 64;
+    }
+  };
+
+  class record_maker {
+    const generator_options& opt;
+    std::vector<double> cumulative;
+
+    int fan_out(splitmix64& rng) const {
+      if (cumulative.empty())
+        return opt.min_fan_out + rng.below(opt.max_fan_out - opt.min_fan_out + 1);
+      double x = rng.uniform() * cumulative.back();
+      auto it = std::upper_bound(cumulative.begin(), cumulative.end(), x);
+      return opt.min_fan_out + std::min<int>(it - cumulative.begin(), cumulative.size() - 1);
+    }
+
+    double number_chance(int level) const {
+      if (opt.number_chance.empty()) return 0;
+      return opt.number_chance[std::min<std::size_t>(level, opt.number_chance.size() - 1)];
+    }
+
+    void make(Ragged_Sequence& r, splitmix64& rng, int level) const {
+      if (level >= opt.depth || rng.uniform() < number_chance(level)) {
+        r.nodes.push_back(-1);
+        r.data.push_back(opt.min_value
+            + int(rng.below(std::uint64_t(opt.max_value - opt.min_value) + 1)));
+        return;
+      }
+      int n = fan_out(rng);
+      r.nodes.push_back(n);
+      for (int i{0}; i < n; ++i)
+        make(r, rng, level+1);
+    }
+
+  public:
+    explicit record_maker(const generator_options& _opt) : opt(_opt) {
+      if (opt.min_fan_out < 0 || opt.max_fan_out < opt.min_fan_out
+          || opt.max_value < opt.min_value)
+        throw std::invalid_argument("generator: bad options");
+      double sum{0};
+      for (double w : opt.fan_out_weights)
+        cumulative.push_back(sum += w);
+      if (!cumulative.empty() && !(sum > 0))
+        throw std::invalid_argument("generator: fan_out_weights must not all be zero");
+    }
+
+    Ragged_Sequence operator()(std::uint64_t index) const {
+      splitmix64 rng {opt.seed ^ splitmix64{index}.next()};
+      Ragged_Sequence r;
+      make(r, rng, 0);
+      return r;
+    }
+  };
+
+  // Generate records in parallel batches and pass them in order to
+  // consume, until opt.leaves numbers have been made.
+  template <typename F>
+  void generate_records(const generator_options& opt, F&& consume, unsigned threads = 0) {
+    const record_maker maker (opt);
+    const std::size_t batch = 4096;
+    std::vector<Ragged_Sequence> records (batch);
+    std::uint64_t leaves{0};
+    for (std::uint64_t first{0}; leaves < opt.leaves; first += batch) {
+      parallel_for(batch, [&](std::size_t i) { records[i] = maker(first + i); }, threads);
+      if (std::all_of(records.begin(), records.end(),
+                      [](const Ragged_Sequence& r) { return r.data.empty(); }))
+        throw std::invalid_argument("generator: options make no numbers");
+      for (auto& r : records) {
+        consume(r);
+        leaves += r.data.size();
+        if (leaves >= opt.leaves) break;
+      }
+    }
+  }
+}
+
+Ragged_Sequence generate_ragged(const generator_options& opt, unsigned threads = 0) {
+  Ragged_Sequence result;
+  result.nodes.push_back(0);
+  generator::generate_records(opt, [&](const Ragged_Sequence& r) {
+    ++result.nodes[0];
+    result.nodes.insert(result.nodes.end(), r.nodes.begin(), r.nodes.end());
+    result.data.insert(result.data.end(), r.data.begin(), r.data.end());
+  }, threads);
+  return result;
+}
+
+Sequence_Table generate_table(const generator_options& opt, unsigned threads = 0) {
+  Sequence_Table result;
+  generator::generate_records(opt, [&](const Ragged_Sequence& r) {
+    result.push_back(r);
+  }, threads);
+  return result;
+}
+
+Raw_Sequence generate(const generator_options& opt, unsigned threads = 0) {
+  vec records;
+  generator::generate_records(opt, [&](const Ragged_Sequence& r) {
+    records.emplace_back(to_raw(r));
+  }, threads);
+  return records;
+}
+
+// Write the generated sequence to path as text, one batch at a time,
+// so the whole sequence is never held in memory.
+void generate_file(const generator_options& opt, const std::string& path, unsigned threads = 0) {
+  std::ofstream out(path, std::ios::trunc);
+  if (!out) throw std::runtime_error(path + ": cannot open for writing");
+  {
+    impl::stream_writer w(out);
+    bool first {true};
+    w.put('[');
+    generator::generate_records(opt, [&](const Ragged_Sequence& r) {
+      if (!first) w.put(", ");
+      first = false;
+      std::size_t node{0}, leaf{0};
+      impl::print_elements(w, r, node, leaf);
+    }, threads);
+    w.put("]\n");
+  }
+  if (!out.flush()) throw std::runtime_error(path + ": write failed");
+}
+
+#endif
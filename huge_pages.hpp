@@ -0,0 +1,171 @@
+#ifndef H_HUGE_PAGES
+#define H_HUGE_PAGES
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include "parallel.hpp"
+#include "sequence.hpp"
+
+// Buffers for large Sequences on huge pages, placed by first touch.
+//
+// Buffers of at least huge_pages::threshold bytes are mapped on their
+// own, 2 MiB aligned, and marked for transparent huge pages. With
+// huge_pages::explicit_pages they are taken from the hugetlbfs pool
+// instead (the default 2 MiB size), falling back to transparent huge
+// pages when the pool is empty. Smaller buffers come from operator new.
+//
+// Elements are default initialised, so a new buffer is not written
+// until it is used. Linux places each page on the NUMA node of the
+// thread that first writes it, so the transpose_distribute overloads
+// below have each worker write the pages of the result it computes.
+// Workers are not pinned: pin the threads (e.g. with numactl or
+// taskset) for the placement to hold.
+namespace huge_pages {
+  constexpr std::size_t page_size {std::size_t(2) << 20};
+  constexpr std::size_t threshold {page_size};
+
+  enum mode { transparent, explicit_pages };
+
+  inline std::size_t mapped_length(std::size_t bytes) {
+    return (bytes + page_size - 1) / page_size * page_size;
+  }
+
+  inline void* map(std::size_t bytes, mode m) {
+    const std::size_t length = mapped_length(bytes);
+#ifdef MAP_HUGETLB
+    if (m == explicit_pages) {
+      void* p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) return p;
+    }
+#endif
+    // Map a page more than needed and trim it to a page boundary
+    const std::size_t padded = length + page_size;
+    void* mapped = ::mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) throw std::bad_alloc();
+    char* first = static_cast<char*>(mapped);
+    char* p = reinterpret_cast<char*>(
+        (reinterpret_cast<std::uintptr_t>(first) + page_size - 1) / page_size * page_size);
+    if (p != first) ::munmap(first, p - first);
+    ::munmap(p + length, first + padded - (p + length));
+#ifdef MADV_HUGEPAGE
+    ::madvise(p, length, MADV_HUGEPAGE);
+#endif
+    return p;
+  }
+
+  inline void unmap(void* p, std::size_t bytes) {
+    ::munmap(p, mapped_length(bytes));
+  }
+}
+
+template <typename T>
+struct huge_page_allocator {
+  using value_type = T;
+  using is_always_equal = std::true_type;
+
+  huge_pages::mode mode {huge_pages::transparent};
+
+  huge_page_allocator() = default;
+  explicit huge_page_allocator(huge_pages::mode m) : mode{m} {}
+  template <typename U>
+  huge_page_allocator(const huge_page_allocator<U>& a) : mode{a.mode} {}
+
+  T* allocate(std::size_t n) {
+    if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+      throw std::bad_array_new_length();
+    const std::size_t bytes = n * sizeof(T);
+    if (bytes < huge_pages::threshold)
+      return static_cast<T*>(::operator new(bytes));
+    return static_cast<T*>(huge_pages::map(bytes, mode));
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    const std::size_t bytes = n * sizeof(T);
+    if (bytes < huge_pages::threshold)
+      ::operator delete(p);
+    else
+      huge_pages::unmap(p, bytes);
+  }
+
+  // Default initialise, so new pages are left untouched
+  template <typename U>
+  void construct(U* p) noexcept(std::is_nothrow_default_constructible_v<U>) {
+    ::new (static_cast<void*>(p)) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U* p, Args&&... args) {
+    ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U>
+  bool operator==(const huge_page_allocator<U>&) const { return true; }
+  template <typename U>
+  bool operator!=(const huge_page_allocator<U>&) const { return false; }
+};
+
+using Huge_Sequence = Basic_Sequence<std::vector<int, huge_page_allocator<int>>>;
+
+namespace huge_pages {
+  // func over the normalised operands da and db into a new result on
+  // huge pages. Each worker computes whole pages of the result, so it
+  // is the first to touch them.
+  template <typename DA, typename DB, typename TF, typename Lengths>
+  Huge_Sequence transform(const DA& da, const DB& db, TF& func, const Lengths& lengths,
+                          const huge_page_allocator<int>& alloc, unsigned threads) {
+    NTD_TIME(transform);
+    NTD_SPAN(span, "transform");
+    impl::check_normalised_sizes(da, db, lengths);
+    Huge_Sequence r (impl::int_vector<huge_page_allocator<int>>(da.size(), alloc),
+                     {lengths.begin(), lengths.end(), alloc});
+    NTD_COUNT(allocations, 1);
+    NTD_COUNT(elements_computed, r.data.size());
+    NTD_SPAN_ARG(span, "output", r.data.size());
+    parallel_ranges(r.data.size(), page_size / sizeof(int), [&](std::size_t first, std::size_t last) {
+      std::transform(da.begin() + first, da.begin() + last, db.begin() + first,
+                     r.data.begin() + first, func);
+    }, threads);
+    return r;
+  }
+}
+
+// transpose_distribute with the result on huge pages, computed by up to
+// threads workers. func is called from several threads at once. The
+// operands are normalised on the calling thread.
+template <typename Policy = default_policy, typename TF>
+Huge_Sequence transpose_distribute(const Raw_Sequence& a, const Raw_Sequence& b, TF&& func,
+                                   const huge_page_allocator<int>& alloc, unsigned threads) {
+  NTD_SPAN(span, "transpose_distribute");
+  auto lengths = get_lengths<typename impl::valid_shapes<Policy>::type>({a,b});
+  auto norm_a = normalise<Policy>(a, lengths, alloc);
+  auto norm_b = normalise<Policy>(b, lengths, alloc);
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "output", norm_a.data.size());
+  return huge_pages::transform(norm_a.data, norm_b.data, func, lengths, alloc, threads);
+}
+
+template <typename Policy = default_policy, typename CA, typename CB, typename TF>
+Huge_Sequence transpose_distribute(const Basic_Sequence<CA>& a, const Basic_Sequence<CB>& b,
+                                   TF&& func, const huge_page_allocator<int>& alloc,
+                                   unsigned threads) {
+  NTD_SPAN(span, "transpose_distribute");
+  std::vector<int> lengths;
+  impl::merge_lengths<Policy>(lengths, a.lengths, b.lengths);
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  return impl::with_normalised(a, b, lengths,
+      [&](const auto& s) { return normalise<Policy>(s, lengths, alloc); },
+      [&](const auto& da, const auto& db) {
+        NTD_SPAN_ARG(span, "output", da.size());
+        return huge_pages::transform(da, db, func, lengths, alloc, threads);
+      });
+}
+
+#endif
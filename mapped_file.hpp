@@ -0,0 +1,54 @@
+#ifndef H_MAPPED_FILE
+#define H_MAPPED_FILE
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file. The mapping is shared, so
+// several processes mapping the same file share its page cache pages.
+struct mapped_file {
+  const char* data{nullptr};
+  std::size_t size{0};
+
+  explicit mapped_file(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::system_error(errno, std::generic_category(), path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      int e = errno;
+      ::close(fd);
+      throw std::system_error(e, std::generic_category(), path);
+    }
+    size = st.st_size;
+    if (size > 0) {
+      void* m = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (m == MAP_FAILED) {
+        int e = errno;
+        ::close(fd);
+        throw std::system_error(e, std::generic_category(), path);
+      }
+      data = static_cast<const char*>(m);
+    }
+    ::close(fd);
+  }
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  ~mapped_file() { if (data) ::munmap(const_cast<char*>(data), size); }
+
+  // Hint to the kernel how the mapping will be read
+  void advise(int advice) const {
+    if (data) ::madvise(const_cast<char*>(data), size, advice);
+  }
+
+  std::string_view text() const { return {data, size}; }
+};
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef H_OUT_OF_CORE
+#define H_OUT_OF_CORE
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "raw_index.hpp"
+#include "sequence.hpp"
+#include "sequence_file.hpp"
+
+// normalise and transpose_distribute for results larger than memory.
+//
+// The output is produced in chunks of at most chunk elements. Each
+// element is read straight from the operands, which are never
+// normalised as a whole. Apart from the operands, memory use is one
+// chunk.
+//
+// The chunks can be pulled one at a time from a chunk_stream, which
+// computes each when asked for it, so a consumer starts on the first
+// chunk straight away:
+//
+//   for (const auto& c : out_of_core::transpose_distribute_chunks(
+//            a, b, std::plus<int>(), get_lengths({a, b})))
+//     consume(c.index, c.data, c.size);
+//
+// or pushed to a sink: any callable sink(const int* data, std::size_t n),
+// such as a sequence_file_writer. The sink gets the elements in order,
+// so a file sink writes sequentially.
+//
+//   auto lengths = get_lengths({a, b});
+//   sequence_file_writer out (path, lengths);
+//   out_of_core::transpose_distribute(a, b, std::plus<int>(), lengths, out);
+//   out.close();
+//   Mapped_Sequence result = load(path);
+//
+// Raw_Sequence operands are read through a Raw_Index, built per call
+// unless one is passed in. Readers and streams refer to Sequence
+// operands, which must outlive them.
+namespace out_of_core {
+  // Elements per chunk, 4 MiB
+  constexpr std::size_t default_chunk {std::size_t(1) << 20};
+
+  inline std::uint64_t product(const std::vector<int>& lengths) {
+    std::uint64_t n {1};
+    for (int l : lengths) n *= std::uint64_t(l);
+    return n;
+  }
+
+  // Elements of a Raw_Sequence normalised to lengths, in order, read
+  // through a Raw_Index. Keeps the nodes on the path from the root to
+  // the current element, so moving to the next element only walks down
+  // from the deepest level that changed.
+  class raw_reader {
+    std::shared_ptr<const Raw_Index> tree;
+    std::vector<int> lengths;
+    std::vector<const Raw_Index::node*> path;
+    std::vector<int> index;
+
+    void descend(std::size_t order) {
+      for (; order < lengths.size(); ++order)
+        path[order+1] = &tree->child(*path[order], order, index[order]);
+    }
+
+  public:
+    raw_reader(std::shared_ptr<const Raw_Index> t, std::vector<int> l)
+      : tree{std::move(t)}, lengths{std::move(l)},
+        path(lengths.size() + 1, &tree->root()), index(lengths.size()) {
+      // As impl::validate_lengths
+      const auto& actual = tree->lengths();
+      for (std::size_t i{0}; i < actual.size(); ++i)
+        if (actual[i] > (i < lengths.size() ? lengths[i] : 0))
+          throw std::invalid_argument("normalise: lengths too small for the Raw_Sequence");
+      for (int l : lengths)
+        if (l < 1) throw std::invalid_argument("normalise: lengths must be positive");
+      descend(0);
+    }
+
+    // Move to element i
+    void seek(std::uint64_t i) {
+      for (std::size_t order{lengths.size()}; order-- > 0;) {
+        index[order] = i % lengths[order];
+        i /= lengths[order];
+      }
+      descend(0);
+    }
+
+    // The current element, then move to the next one
+    int next() {
+      const int x = int(path.back()->first);
+      std::size_t order {lengths.size()};
+      while (order > 0 && ++index[order-1] == lengths[order-1])
+        index[--order] = 0;
+      if (order > 0) descend(order-1);
+      return x;
+    }
+  };
+
+  // Elements of a Sequence normalised to lengths, in order. Levels the
+  // Sequence is short of repeat its elements, as in normalise.
+  template <typename Container>
+  class sequence_reader {
+    const Basic_Sequence<Container>& s;
+    std::vector<int> lengths;
+    std::vector<int> own_lengths;
+    std::vector<std::uint64_t> strides;
+    // Offset into s.data of the first element below each level
+    std::vector<std::uint64_t> offsets;
+    std::vector<int> index;
+
+    void descend(std::size_t order) {
+      for (; order < lengths.size(); ++order)
+        offsets[order+1] = offsets[order] + index[order] % own_lengths[order] * strides[order];
+    }
+
+  public:
+    sequence_reader(const Basic_Sequence<Container>& seq, std::vector<int> l)
+      : s{seq}, lengths{std::move(l)}, own_lengths(lengths.size(), 1), strides(lengths.size()),
+        offsets(lengths.size() + 1), index(lengths.size()) {
+      impl::validate_lengths(s, lengths);
+      if (s.lengths.size() > lengths.size())
+        throw std::invalid_argument("normalise: lengths too small for the Sequence");
+      std::copy(s.lengths.begin(), s.lengths.end(),
+                own_lengths.end() - s.lengths.size());
+      for (std::size_t order{0}; order < lengths.size(); ++order)
+        if (own_lengths[order] > lengths[order])
+          throw std::invalid_argument("normalise: lengths too small for the Sequence");
+      std::uint64_t stride {1};
+      for (std::size_t order{lengths.size()}; order-- > 0;) {
+        strides[order] = stride;
+        stride *= own_lengths[order];
+      }
+      descend(0);
+    }
+
+    void seek(std::uint64_t i) {
+      for (std::size_t order{lengths.size()}; order-- > 0;) {
+        index[order] = i % lengths[order];
+        i /= lengths[order];
+      }
+      descend(0);
+    }
+
+    int next() {
+      const int x = s.data[offsets.back()];
+      std::size_t order {lengths.size()};
+      while (order > 0 && ++index[order-1] == lengths[order-1])
+        index[--order] = 0;
+      if (order > 0) descend(order-1);
+      return x;
+    }
+  };
+
+  inline raw_reader reader(const Raw_Sequence& s, const std::vector<int>& lengths) {
+    return {std::make_shared<const Raw_Index>(s), lengths};
+  }
+
+  // An index built once can be shared by several readers
+  inline raw_reader reader(std::shared_ptr<const Raw_Index> s, const std::vector<int>& lengths) {
+    return {std::move(s), lengths};
+  }
+
+  template <typename Container>
+  sequence_reader<Container> reader(const Basic_Sequence<Container>& s,
+                                    const std::vector<int>& lengths) {
+    return {s, lengths};
+  }
+
+  // Sources of output elements, in order, for chunk_stream
+  template <typename Reader>
+  struct normalised_source {
+    static constexpr bool computes {false};
+    Reader in;
+    int next() { return in.next(); }
+  };
+
+  template <typename ReaderA, typename ReaderB, typename TF>
+  struct transpose_distribute_source {
+    static constexpr bool computes {true};
+    ReaderA a;
+    ReaderB b;
+    TF func;
+    int next() {
+      const int x = a.next();
+      return func(x, b.next());
+    }
+  };
+
+  // A block of output elements: the index of its first element in the
+  // output, that element's index at each level, and the elements
+  struct chunk {
+    std::uint64_t first {0};
+    std::vector<int> index;
+    const int* data {nullptr};
+    std::size_t size {0};
+  };
+
+  // Output elements computed a chunk at a time, as they are asked for.
+  // Call next() and read current(), or iterate over the chunks; each
+  // chunk is overwritten by the one after it.
+  template <typename Source>
+  class chunk_stream {
+    Source source;
+    std::vector<int> lengths;
+    std::uint64_t n;
+    std::vector<int> buffer;
+    chunk c;
+    bool started {false};
+
+  public:
+    chunk_stream(Source s, std::vector<int> l, std::size_t chunk_size)
+      : source{std::move(s)}, lengths{std::move(l)}, n{product(lengths)},
+        buffer(std::min<std::uint64_t>(n, std::max<std::size_t>(chunk_size, 1))) {
+      c.index.assign(lengths.size(), 0);
+    }
+
+    std::uint64_t size() const { return n; }
+    const std::vector<int>& output_lengths() const { return lengths; }
+    const chunk& current() const { return c; }
+
+    // Compute the next chunk, false once all of them have been
+    bool next() {
+      c.first += c.size;
+      started = true;
+      if (c.first >= n) {
+        c.size = 0;
+        return false;
+      }
+      c.size = std::min<std::uint64_t>(buffer.size(), n - c.first);
+      if constexpr (Source::computes) NTD_COUNT(elements_computed, c.size);
+      for (std::size_t i{0}; i < c.size; ++i)
+        buffer[i] = source.next();
+      c.data = buffer.data();
+      std::uint64_t i {c.first};
+      for (std::size_t order{lengths.size()}; order-- > 0;) {
+        c.index[order] = i % lengths[order];
+        i /= lengths[order];
+      }
+      return true;
+    }
+
+    class iterator {
+      chunk_stream* s {nullptr};
+    public:
+      using iterator_category = std::input_iterator_tag;
+      using value_type = chunk;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const chunk*;
+      using reference = const chunk&;
+
+      iterator() {}
+      explicit iterator(chunk_stream* stream) : s{stream} {}
+      reference operator*() const { return s->c; }
+      pointer operator->() const { return &s->c; }
+      iterator& operator++() {
+        if (!s->next()) s = nullptr;
+        return *this;
+      }
+      bool operator==(const iterator& o) const { return s == o.s; }
+      bool operator!=(const iterator& o) const { return s != o.s; }
+    };
+
+    // Starts from the first chunk, or carries on from the current one
+    iterator begin() {
+      if (!started && !next()) return end();
+      return c.size ? iterator{this} : end();
+    }
+    iterator end() { return {}; }
+  };
+
+  template <typename S>
+  auto normalised_chunks(const S& s, const std::vector<int>& lengths,
+                         std::size_t chunk = default_chunk) {
+    using source = normalised_source<decltype(reader(s, lengths))>;
+    return chunk_stream<source>(source{reader(s, lengths)}, lengths, chunk);
+  }
+
+  // lengths must fit both operands, e.g. get_lengths({a, b})
+  template <typename A, typename B, typename TF>
+  auto transpose_distribute_chunks(const A& a, const B& b, TF&& func,
+                                   const std::vector<int>& lengths,
+                                   std::size_t chunk = default_chunk) {
+    using source = transpose_distribute_source<decltype(reader(a, lengths)),
+        decltype(reader(b, lengths)), std::decay_t<TF>>;
+    return chunk_stream<source>(
+        source{reader(a, lengths), reader(b, lengths), std::forward<TF>(func)}, lengths, chunk);
+  }
+
+  // Write s normalised to lengths to sink, chunk elements at a time
+  template <typename S, typename Sink>
+  void normalise(const S& s, const std::vector<int>& lengths, Sink&& sink,
+                 std::size_t chunk = default_chunk) {
+    NTD_TIME(normalise_raw);
+    NTD_SPAN(span, "normalise");
+    NTD_SPAN_ARG(span, "rank", lengths.size());
+    NTD_SPAN_ARG(span, "output", product(lengths));
+    for (const auto& c : normalised_chunks(s, lengths, chunk))
+      sink(c.data, c.size);
+  }
+
+  // Write transpose_distribute of a and b to sink, chunk elements at a
+  // time. lengths must fit both operands, e.g. get_lengths({a, b}).
+  template <typename A, typename B, typename TF, typename Sink>
+  void transpose_distribute(const A& a, const B& b, TF&& func, const std::vector<int>& lengths,
+                            Sink&& sink, std::size_t chunk = default_chunk) {
+    NTD_SPAN(span, "transpose_distribute");
+    NTD_SPAN_ARG(span, "rank", lengths.size());
+    NTD_SPAN_ARG(span, "output", product(lengths));
+    for (const auto& c : transpose_distribute_chunks(a, b, std::forward<TF>(func), lengths, chunk))
+      sink(c.data, c.size);
+  }
+}
+
+#endif
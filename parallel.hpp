@@ -0,0 +1,66 @@
+#ifndef H_PARALLEL
+#define H_PARALLEL
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of worker threads used when none is given
+inline unsigned default_threads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Run f(i) for every i in [0, n) on up to threads worker threads.
+// Indices are handed out one at a time so uneven work still balances.
+// The first exception thrown by f is rethrown once all workers stop.
+template <typename F>
+void parallel_for(std::size_t n, F&& f, unsigned threads = 0) {
+  if (threads == 0) threads = default_threads();
+  if (n < threads) threads = n;
+  if (threads <= 1) {
+    for (std::size_t i{0}; i < n; ++i) f(i);
+    return;
+  }
+
+  std::atomic<std::size_t> next {0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto work = [&] {
+    for (std::size_t i; (i = next++) < n; ) {
+      try {
+        f(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) error = std::current_exception();
+        next = n;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned t{1}; t < threads; ++t)
+    workers.emplace_back(work);
+  work();
+  for (auto& w : workers) w.join();
+  if (error) std::rethrow_exception(error);
+}
+
+// Run f(first, last) over [0, n) split into one contiguous range per
+// worker thread, with range boundaries on multiples of granule. Each
+// range is run start to end on a single thread.
+template <typename F>
+void parallel_ranges(std::size_t n, std::size_t granule, F&& f, unsigned threads = 0) {
+  if (threads == 0) threads = default_threads();
+  const std::size_t granules = (n + granule - 1) / granule;
+  const std::size_t per_range = (granules + threads - 1) / threads * granule;
+  if (per_range == 0) return;
+  parallel_for((n + per_range - 1) / per_range, [&](std::size_t r) {
+    f(r * per_range, std::min(n, (r+1) * per_range));
+  }, threads);
+}
+
+#endif
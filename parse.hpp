@@ -0,0 +1,178 @@
+#ifndef H_PARSE
+#define H_PARSE
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include "mapped_file.hpp"
+#include "sequence.hpp"
+
+// Parse nested list literals such as [[2,7,8],[4,8]] straight into
+// a Ragged_Sequence or a Raw_Sequence.
+namespace parser {
+  inline bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+  }
+
+  // Number of leading digits in the 8 bytes starting at p, found with
+  // SWAR byte arithmetic instead of one compare per character.
+  inline int count_digits8(const char* p, std::uint64_t& word) {
+    std::memcpy(&word, p, 8);
+    std::uint64_t t = word - 0x3030303030303030ull;
+    std::uint64_t non_digit = ((t + 0x7676767676767676ull) | t) & 0x8080808080808080ull;
+    return non_digit ? __builtin_ctzll(non_digit) / 8 : 8;
+  }
+
+  // Convert n (1 to 8) ASCII digits held in the low bytes of word.
+  inline std::uint32_t convert_digits8(std::uint64_t word, int n) {
+    if (n < 8) word <<= 8 * (8 - n);
+    word = ((word & 0x0F0F0F0F0F0F0F0Full) * 2561) >> 8;
+    word = ((word & 0x00FF00FF00FF00FFull) * 6553601) >> 16;
+    return std::uint32_t(((word & 0x0000FFFF0000FFFFull) * 42949672960001ull) >> 32);
+  }
+
+  [[noreturn]] inline void error(const char* what, std::size_t pos) {
+    throw std::invalid_argument(
+        std::string("parse error: ") + what + " at offset " + std::to_string(pos));
+  }
+
+  // Scan text and report begin_list, end_list and value events to b.
+  // Nesting is tracked with an explicit depth counter rather than
+  // recursion so deep inputs cannot overflow the stack.
+  template <typename Builder>
+  void scan(std::string_view text, Builder& b) {
+    constexpr std::int64_t pow10[] {1, 10, 100, 1000, 10000, 100000,
+                                     1000000, 10000000, 100000000};
+    constexpr std::int64_t limit = std::int64_t(INT32_MAX) + 1;
+    const char* const first = text.data();
+    const char* p = first;
+    const char* const last = first + text.size();
+    int depth{0};
+    bool expect_value{true};
+
+    auto skip_space = [&] { while (p != last && is_space(*p)) ++p; };
+
+    for (;;) {
+      skip_space();
+      if (p == last) error("unexpected end of input", p - first);
+
+      if (expect_value) {
+        if (*p == '[') {
+          ++p;
+          ++depth;
+          b.begin_list();
+          skip_space();
+          if (p != last && *p == ']') expect_value = false;
+          continue;
+        }
+
+        bool negative = (*p == '-');
+        if (negative) ++p;
+        std::int64_t x{0};
+        int n{0};
+        while (last - p >= 8) {
+          std::uint64_t word;
+          int d = count_digits8(p, word);
+          if (d == 0) break;
+          x = x * pow10[d] + convert_digits8(word, d);
+          p += d;
+          n += d;
+          if (x > limit) error("integer out of range", p - first);
+          if (d < 8) break;
+        }
+        // Too close to the end for a word load, finish one by one
+        while (p != last && unsigned(*p - '0') < 10) {
+          x = x * 10 + (*p++ - '0');
+          ++n;
+          if (x > limit) error("integer out of range", p - first);
+        }
+        if (n == 0) error("expected a number or '['", p - first);
+        if (negative) x = -x;
+        if (x > INT32_MAX) error("integer out of range", p - first);
+        b.value(int(x));
+        expect_value = false;
+      } else {
+        if (depth == 0) error("trailing characters", p - first);
+        if (*p == ',') {
+          ++p;
+          expect_value = true;
+        } else if (*p == ']') {
+          ++p;
+          --depth;
+          b.end_list();
+        } else {
+          error("expected ',' or ']'", p - first);
+        }
+      }
+
+      if (depth == 0 && !expect_value) {
+        skip_space();
+        if (p != last) error("trailing characters", p - first);
+        return;
+      }
+    }
+  }
+
+  struct ragged_builder {
+    Ragged_Sequence r;
+    std::vector<int> open;  // positions in r.nodes of the open vectors
+
+    void count() { if (!open.empty()) ++r.nodes[open.back()]; }
+    void begin_list() {
+      count();
+      open.push_back(r.nodes.size());
+      r.nodes.push_back(0);
+    }
+    void end_list() { open.pop_back(); }
+    void value(int x) {
+      count();
+      r.nodes.push_back(-1);
+      r.data.push_back(x);
+    }
+  };
+
+  struct raw_builder {
+    Raw_Sequence result;
+    std::vector<vec> open;  // the vectors still being filled
+
+    void begin_list() { open.emplace_back(); }
+    void end_list() {
+      vec v = std::move(open.back());
+      open.pop_back();
+      if (open.empty()) result = std::move(v);
+      else open.back().emplace_back(std::move(v));
+    }
+    void value(int x) {
+      if (open.empty()) result = x;
+      else open.back().emplace_back(x);
+    }
+  };
+}
+
+Ragged_Sequence parse_ragged(std::string_view text) {
+  parser::ragged_builder b;
+  parser::scan(text, b);
+  return std::move(b.r);
+}
+
+Raw_Sequence parse(std::string_view text) {
+  parser::raw_builder b;
+  parser::scan(text, b);
+  return std::move(b.result);
+}
+
+Ragged_Sequence parse_ragged_file(const std::string& path) {
+  mapped_file f(path);
+  f.advise(MADV_SEQUENTIAL);
+  return parse_ragged(f.text());
+}
+
+Raw_Sequence parse_file(const std::string& path) {
+  mapped_file f(path);
+  f.advise(MADV_SEQUENTIAL);
+  return parse(f.text());
+}
+
+#endif
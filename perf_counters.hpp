@@ -0,0 +1,96 @@
+#ifndef H_PERF_COUNTERS
+#define H_PERF_COUNTERS
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware performance counters of the calling thread, read through
+// perf_event_open. Each counter is opened on its own, so counters the
+// machine or kernel does not allow (e.g. in containers, or with a high
+// perf_event_paranoid) are just reported as unavailable.
+class perf_counters {
+public:
+  enum counter {
+    cycles,
+    instructions,
+    l1d_misses,
+    llc_misses,
+    branch_misses,
+    counter_count
+  };
+
+  static constexpr const char* names[counter_count] {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"
+  };
+
+  perf_counters() {
+    constexpr std::uint64_t l1d_read_miss =
+        PERF_COUNT_HW_CACHE_L1D
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const std::pair<std::uint32_t, std::uint64_t> events[counter_count] {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, l1d_read_miss},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    for (int c{0}; c < counter_count; ++c) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof attr);
+      attr.size = sizeof attr;
+      attr.type = events[c].first;
+      attr.config = events[c].second;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+  }
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+  ~perf_counters() {
+    for (int fd : fds)
+      if (fd >= 0) close(fd);
+  }
+
+  bool available(counter c) const { return fds[c] >= 0; }
+  bool any_available() const {
+    for (int fd : fds)
+      if (fd >= 0) return true;
+    return false;
+  }
+
+  void start() {
+    for (int fd : fds) {
+      if (fd < 0) continue;
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+
+  void stop() {
+    for (int fd : fds)
+      if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  }
+
+  // Count since start(), scaled up if the kernel multiplexed the
+  // counter, or -1 if the counter is unavailable.
+  double read(counter c) const {
+    if (fds[c] < 0) return -1;
+    std::uint64_t v[3];
+    if (::read(fds[c], v, sizeof v) != sizeof v || v[2] == 0) return -1;
+    return double(v[0]) * double(v[1]) / double(v[2]);
+  }
+
+private:
+  int fds[counter_count];
+};
+
+#endif
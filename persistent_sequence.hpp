@@ -0,0 +1,303 @@
+#ifndef H_PERSISTENT_SEQUENCE
+#define H_PERSISTENT_SEQUENCE
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "sequence.hpp"
+
+// An immutable Raw_Sequence for inputs that change by small edits.
+//
+// The nodes are shared between versions: an edit copies the nodes on
+// the path from the root to the change and shares every other subtree
+// with the version it was made from, which stays as it was. Each node
+// keeps the lengths of its subtree, as get_lengths, so get_lengths
+// after an edit is O(1), the lengths having been recomputed only along
+// the changed path.
+//
+// The children of a vector are kept in a tree of chunks of up to
+// width entries, filled from the left, and each chunk keeps the
+// longest lengths below it. Replacing or appending a child copies one
+// chunk per level of that tree and merges the lengths of its entries,
+// so an edit at depth d of a Raw_Sequence of rank r whose vectors have
+// up to n elements costs O(d * log(n) * width * r), not O(d * n * r).
+//
+//   Persistent_Sequence a (Raw_Sequence(vec{ vec{1,2}, vec{3} }));
+//   auto b = a.push_back({1}, 4);   // a is still { {1,2}, {3} }
+//   auto c = b.set({0}, vec{5,6,7});
+//   get_lengths(c);                 // {2,3}
+class Persistent_Sequence {
+  struct node;
+  struct chunk;
+  using pointer = std::shared_ptr<const node>;
+  using chunk_pointer = std::shared_ptr<const chunk>;
+
+  static constexpr int bits {5};
+  static constexpr std::size_t width {std::size_t(1) << bits};
+
+  struct node {
+    bool number {true};
+    int value {0};
+    // The children, in a tree of chunks shift levels above the bottom
+    chunk_pointer children;
+    std::size_t count {0};
+    int shift {0};
+    // get_lengths of the subtree, empty for a number
+    std::vector<int> lengths;
+  };
+
+  // Children at the bottom of the tree, chunks above it
+  struct chunk {
+    std::vector<pointer> nodes;
+    std::vector<chunk_pointer> chunks;
+    // The longest lengths of the children below, at each level
+    std::vector<int> lengths;
+  };
+
+  pointer root;
+
+  explicit Persistent_Sequence(pointer p) : root{std::move(p)} {}
+
+  static void merge(std::vector<int>& into, const std::vector<int>& l) {
+    if (l.size() > into.size()) into.resize(l.size());
+    for (std::size_t i{0}; i < l.size(); ++i)
+      into[i] = std::max(into[i], l[i]);
+  }
+
+  static chunk_pointer make_chunk(std::vector<pointer> nodes) {
+    auto c = std::make_shared<chunk>();
+    for (const auto& x : nodes) merge(c->lengths, x->lengths);
+    c->nodes = std::move(nodes);
+    return c;
+  }
+
+  static chunk_pointer make_chunk(std::vector<chunk_pointer> chunks) {
+    auto c = std::make_shared<chunk>();
+    for (const auto& x : chunks) merge(c->lengths, x->lengths);
+    c->chunks = std::move(chunks);
+    return c;
+  }
+
+  static pointer make(int x) {
+    NTD_COUNT(allocations, 1);
+    auto n = std::make_shared<node>();
+    n->value = x;
+    return n;
+  }
+
+  static pointer make(chunk_pointer children, std::size_t count, int shift) {
+    NTD_COUNT(allocations, 1);
+    auto n = std::make_shared<node>();
+    n->number = false;
+    n->lengths.push_back(count);
+    if (children)
+      n->lengths.insert(n->lengths.end(), children->lengths.begin(), children->lengths.end());
+    n->children = std::move(children);
+    n->count = count;
+    n->shift = shift;
+    return n;
+  }
+
+  static pointer make(std::vector<pointer> children) {
+    const std::size_t count = children.size();
+    if (count == 0) return make(nullptr, 0, 0);
+    std::vector<chunk_pointer> level;
+    for (std::size_t i{0}; i < count; i += width)
+      level.push_back(make_chunk(std::vector<pointer>(
+          children.begin() + i, children.begin() + std::min(count, i + width))));
+    int shift {0};
+    for (; level.size() > 1; ++shift) {
+      std::vector<chunk_pointer> above;
+      for (std::size_t i{0}; i < level.size(); i += width)
+        above.push_back(make_chunk(std::vector<chunk_pointer>(
+            level.begin() + i, level.begin() + std::min(level.size(), i + width))));
+      std::swap(level, above);
+    }
+    return make(std::move(level[0]), count, shift);
+  }
+
+  static std::size_t slot(std::size_t i, int shift) { return (i >> (bits * shift)) & (width - 1); }
+
+  // c with child i replaced by x
+  static chunk_pointer assign(const chunk& c, int shift, std::size_t i, pointer x) {
+    if (shift == 0) {
+      auto nodes = c.nodes;
+      nodes[slot(i, 0)] = std::move(x);
+      return make_chunk(std::move(nodes));
+    }
+    auto chunks = c.chunks;
+    chunks[slot(i, shift)] = assign(*chunks[slot(i, shift)], shift-1, i, std::move(x));
+    return make_chunk(std::move(chunks));
+  }
+
+  // c, which may be null, with x appended as child i
+  static chunk_pointer append(const chunk* c, int shift, std::size_t i, pointer x) {
+    if (shift == 0) {
+      std::vector<pointer> nodes;
+      if (c) nodes = c->nodes;
+      nodes.push_back(std::move(x));
+      return make_chunk(std::move(nodes));
+    }
+    std::vector<chunk_pointer> chunks;
+    if (c) chunks = c->chunks;
+    const std::size_t j = slot(i, shift);
+    if (j < chunks.size())
+      chunks[j] = append(chunks[j].get(), shift-1, i, std::move(x));
+    else
+      chunks.push_back(append(nullptr, shift-1, i, std::move(x)));
+    return make_chunk(std::move(chunks));
+  }
+
+  template <typename F>
+  static void for_each(const chunk& c, F& f) {
+    for (const auto& x : c.nodes) f(x);
+    for (const auto& x : c.chunks) for_each(*x, f);
+  }
+
+  static pointer build(const Raw_Sequence& s) {
+    NTD_COUNT(nodes_visited, 1);
+    if (const int* x = std::get_if<int>(&s)) return make(*x);
+    const vec& v = std::get<vec>(s);
+    std::vector<pointer> children;
+    children.reserve(v.size());
+    for (const auto& x : v)
+      children.push_back(build(x.data));
+    return make(std::move(children));
+  }
+
+  static void to_raw(const node& x, Raw_Sequence& s) {
+    if (x.number) {
+      s = x.value;
+      return;
+    }
+    vec v (x.count);
+    std::size_t i {0};
+    auto f = [&](const pointer& c) { to_raw(*c, v[i++].data); };
+    if (x.children) for_each(*x.children, f);
+    s = std::move(v);
+  }
+
+  static const pointer& child(const pointer& x, int i) {
+    if (x->number)
+      throw std::out_of_range("Persistent_Sequence: path goes below a number");
+    if (i < 0 || std::size_t(i) >= x->count)
+      throw std::out_of_range("Persistent_Sequence: path out of range");
+    const chunk* c = x->children.get();
+    for (int shift{x->shift}; shift > 0; --shift)
+      c = c->chunks[slot(i, shift)].get();
+    return c->nodes[slot(i, 0)];
+  }
+
+  // Copies of the nodes down path, with the subtree at its end replaced
+  // by edit(subtree)
+  template <typename F>
+  static pointer update(const pointer& x, const int* path, std::size_t n, F& edit) {
+    NTD_COUNT(nodes_visited, 1);
+    if (n == 0) return edit(x);
+    pointer next = update(child(x, *path), path+1, n-1, edit);
+    return make(assign(*x->children, x->shift, *path, std::move(next)), x->count, x->shift);
+  }
+
+public:
+  Persistent_Sequence() : root{make(0)} {}
+  explicit Persistent_Sequence(int x) : root{make(x)} {}
+  explicit Persistent_Sequence(const Raw_Sequence& s) : root{build(s)} {}
+
+  bool is_number() const { return root->number; }
+  // The number, for a Persistent_Sequence that is one
+  int value() const {
+    if (!root->number) throw std::invalid_argument("Persistent_Sequence: not a number");
+    return root->value;
+  }
+  // Number of children, 0 for a number
+  std::size_t size() const { return root->count; }
+  const std::vector<int>& lengths() const { return root->lengths; }
+
+  // The subtree at path, sharing its nodes
+  Persistent_Sequence at(const std::vector<int>& path) const {
+    const pointer* x = &root;
+    for (int i : path) x = &child(*x, i);
+    return Persistent_Sequence(*x);
+  }
+  Persistent_Sequence operator[](int i) const { return Persistent_Sequence(child(root, i)); }
+
+  // A new version with the subtree at path replaced by x
+  Persistent_Sequence set(const std::vector<int>& path, const Persistent_Sequence& x) const {
+    auto edit = [&](const pointer&) { return x.root; };
+    return Persistent_Sequence(update(root, path.data(), path.size(), edit));
+  }
+  Persistent_Sequence set(const std::vector<int>& path, const Raw_Sequence& x) const {
+    return set(path, Persistent_Sequence(x));
+  }
+
+  // A new version with x appended to the vector at path
+  Persistent_Sequence push_back(const std::vector<int>& path, const Persistent_Sequence& x) const {
+    auto edit = [&](const pointer& v) {
+      if (v->number)
+        throw std::invalid_argument("Persistent_Sequence: push_back onto a number");
+      // A full tree of chunks gets a new level on top
+      if (v->count == std::size_t(1) << (bits * (v->shift + 1)))
+        return make(append(make_chunk(std::vector<chunk_pointer>{v->children}).get(),
+                           v->shift + 1, v->count, x.root), v->count + 1, v->shift + 1);
+      return make(append(v->children.get(), v->shift, v->count, x.root), v->count + 1, v->shift);
+    };
+    return Persistent_Sequence(update(root, path.data(), path.size(), edit));
+  }
+  Persistent_Sequence push_back(const std::vector<int>& path, const Raw_Sequence& x) const {
+    return push_back(path, Persistent_Sequence(x));
+  }
+
+  // Copy into a Raw_Sequence
+  Raw_Sequence raw() const {
+    Raw_Sequence s;
+    to_raw(*root, s);
+    return s;
+  }
+
+  // Whether both are the same nodes, not just equal
+  bool shares(const Persistent_Sequence& o) const { return root == o.root; }
+
+  friend bool operator==(const Persistent_Sequence& a, const Persistent_Sequence& b) {
+    if (a.root == b.root) return true;
+    if (a.root->number || b.root->number)
+      return a.root->number == b.root->number && a.root->value == b.root->value;
+    if (a.size() != b.size() || a.lengths() != b.lengths()) return false;
+    for (std::size_t i{0}; i < a.size(); ++i)
+      if (!(a[i] == b[i])) return false;
+    return true;
+  }
+  friend bool operator!=(const Persistent_Sequence& a, const Persistent_Sequence& b) {
+    return !(a == b);
+  }
+};
+
+// The cached lengths of the root, as get_lengths of the Raw_Sequence
+inline std::vector<int> get_lengths(const Persistent_Sequence& s) {
+  NTD_TIME(get_lengths);
+  NTD_SPAN(span, "get_lengths");
+  if (s.is_number()) return {0};
+  NTD_SPAN_ARG(span, "rank", s.lengths().size());
+  return s.lengths();
+}
+
+// normalise and transpose_distribute go through a Raw_Sequence copy
+template <typename Policy = default_policy>
+Sequence normalise(const Persistent_Sequence& s, const std::vector<int>& lengths) {
+  return normalise<Policy>(s.raw(), lengths);
+}
+
+template <typename Policy = default_policy, typename TF>
+Sequence transpose_distribute(const Persistent_Sequence& a, const Persistent_Sequence& b,
+                              TF&& func) {
+  return transpose_distribute<Policy>(a.raw(), b.raw(), std::forward<TF>(func));
+}
+
+inline std::ostream &operator<< (std::ostream &os, const Persistent_Sequence& s) {
+  return os << s.raw();
+}
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef H_RAW_INDEX
+#define H_RAW_INDEX
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+#include "sequence.hpp"
+
+// Random access into the normalised form of a Raw_Sequence, without
+// normalising it.
+//
+// The nodes are stored level by level. A vector node keeps the number
+// of its children and where they start in the next level; a number
+// keeps its value. The element of normalise(s, lengths) at index
+// (i0, i1, ...) is found by walking down one node per level: a vector
+// of n children goes to child i % n, as copy_elements cycles them,
+// and a number is the element for every index below it, as
+// copy_elements broadcasts it. So a lookup is O(rank).
+class Raw_Index {
+public:
+  struct node {
+    int count;            // number of children, or -1 for a number
+    std::int64_t first;   // first child in the next level, or the number
+  };
+
+private:
+  std::vector<std::vector<node>> nodes;
+  std::vector<int> own_lengths {0};
+  // Number of nodes in the levels above each level
+  std::vector<std::int64_t> level_offsets;
+
+public:
+  explicit Raw_Index(const Raw_Sequence& s) {
+    std::vector<const Raw_Sequence*> level {&s}, next;
+    for (std::size_t order{0}; !level.empty(); ++order) {
+      std::vector<node>& n = nodes.emplace_back(level.size());
+      next.clear();
+      int longest {-1};
+      for (std::size_t i{0}; i < level.size(); ++i) {
+        const vec* v = std::get_if<vec>(level[i]);
+        if (!v) {
+          n[i] = {-1, std::get<int>(*level[i])};
+          continue;
+        }
+        n[i] = {int(v->size()), std::int64_t(next.size())};
+        longest = std::max<int>(longest, v->size());
+        for (const auto& child : *v)
+          next.push_back(&child.data);
+      }
+      if (longest >= 0) {
+        if (order == own_lengths.size()) own_lengths.push_back(0);
+        own_lengths[order] = longest;
+      }
+      std::swap(level, next);
+    }
+    level_offsets.push_back(0);
+    for (const auto& n : nodes)
+      level_offsets.push_back(level_offsets.back() + n.size());
+  }
+
+  // The lengths of the Raw_Sequence, as get_lengths
+  const std::vector<int>& lengths() const { return own_lengths; }
+  std::size_t levels() const { return nodes.size(); }
+  // Number of nodes, vectors and numbers
+  std::int64_t size() const { return level_offsets.back(); }
+  // Position of x, at level order, among all the nodes
+  std::int64_t id(const node& x, std::size_t order) const {
+    return level_offsets[order] + (&x - nodes[order].data());
+  }
+  const node& root() const { return nodes[0][0]; }
+
+  // The node a walk from x, at level order, goes to for index i, which
+  // must not be negative
+  const node& child(const node& x, std::size_t order, int i) const {
+    if (x.count < 0) return x;
+    if (x.count == 0)
+      throw std::out_of_range("repeat_elements: nothing to repeat");
+    return nodes[order+1][x.first + (i < x.count ? i : i % x.count)];
+  }
+
+  // Element at index of the Raw_Sequence normalised to lengths of
+  // rank n. Any non-negative index works, as the levels repeat; a
+  // negative one is std::out_of_range.
+  int at(const int* index, std::size_t n) const {
+    if (std::any_of(index, index + n, [](int i) { return i < 0; }))
+      throw std::out_of_range("Raw_Index: negative index");
+    const node* x = &root();
+    for (std::size_t order{0}; order < n && x->count >= 0; ++order)
+      x = &child(*x, order, index[order]);
+    if (x->count >= 0)
+      throw std::invalid_argument("Raw_Index: index shorter than the Raw_Sequence");
+    return int(x->first);
+  }
+
+  int at(const std::vector<int>& index) const { return at(index.data(), index.size()); }
+  int operator()(std::initializer_list<int> index) const {
+    return at(index.begin(), index.size());
+  }
+};
+
+namespace unique {
+  struct walk {
+    const Raw_Index& a;
+    const Raw_Index& b;
+    const std::vector<int>& lengths;
+    // Number of elements below each level
+    std::vector<std::uint64_t> blocks;
+    std::size_t computed {0};
+
+    // Write the block of the output at level order, below nodes x and
+    // y, to out.
+    //
+    // A node has one parent, so the walk reaches the same pair of nodes
+    // twice only below the same pair of parents, when cycling x and y
+    // comes back to where both started: index i is the same pair as
+    // i - p, for p the least common multiple of their counts. The block
+    // for i is then copied from there, so func is called once per
+    // distinct pair, with no table of the pairs.
+    template <typename TF>
+    void fill(TF& func, const Raw_Index::node* x, const Raw_Index::node* y, std::size_t order,
+              int* out) {
+      if (x->count < 0 && y->count < 0) {
+        // Both are numbers, so the whole block is one result
+        ++computed;
+        std::fill(out, out + blocks[order], func(int(x->first), int(y->first)));
+        return;
+      }
+      const std::uint64_t block = blocks[order+1];
+      const std::uint64_t period = std::lcm<std::uint64_t>(x->count < 0 ? 1 : x->count,
+                                                           y->count < 0 ? 1 : y->count);
+      if (order + 1 == lengths.size()) {
+        // The children are numbers, one per element
+        const int n = int(std::min<std::uint64_t>(period, lengths[order]));
+        for (int i{0}; i < n; ++i)
+          out[i] = func(int(a.child(*x, order, i).first), int(b.child(*y, order, i).first));
+        computed += n;
+        for (int i{n}; i < lengths[order]; ++i)
+          out[i] = out[i - n];
+        return;
+      }
+      for (int i{0}; i < lengths[order]; ++i) {
+        int* to = out + i * block;
+        if (period > 0 && std::uint64_t(i) >= period)
+          std::copy(to - period * block, to - period * block + block, to);
+        else
+          fill(func, &a.child(*x, order, i), &b.child(*y, order, i), order+1, to);
+      }
+    }
+  };
+
+  // Number of numbers in s, at level order, merging its lengths into
+  // lengths
+  inline std::uint64_t numbers(const Raw_Sequence& s, std::vector<int>& lengths,
+                               std::size_t order = 0) {
+    const vec* v = std::get_if<vec>(&s);
+    if (!v) return 1;
+    if (order == lengths.size()) lengths.push_back(0);
+    lengths[order] = std::max<int>(lengths[order], v->size());
+    std::uint64_t n {0};
+    for (const auto& x : *v) n += numbers(x.data, lengths, order+1);
+    return n;
+  }
+}
+
+// transpose_distribute that calls func once per distinct pair of
+// numbers from a and b, and copies the result to every element that
+// pair makes. Where both operands have a number above the last level,
+// the whole block below is filled at once. func must give the same
+// result for the same arguments.
+template <typename TF>
+Sequence transpose_distribute_unique(const Raw_Index& a, const Raw_Index& b, TF&& func) {
+  NTD_SPAN(span, "transpose_distribute");
+  std::vector<int> lengths (std::max(a.lengths().size(), b.lengths().size()));
+  for (const auto* l : {&a.lengths(), &b.lengths()})
+    for (std::size_t i{0}; i < l->size(); ++i)
+      lengths[i] = std::max(lengths[i], (*l)[i]);
+  std::vector<std::uint64_t> blocks (lengths.size() + 1, 1);
+  for (std::size_t order{lengths.size()}; order-- > 0;)
+    blocks[order] = blocks[order+1] * lengths[order];
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "output", blocks[0]);
+
+  NTD_TIME(transform);
+  NTD_SPAN(transform_span, "transform");
+  std::vector<int> result (blocks[0]);
+  NTD_COUNT(allocations, 1);
+  unique::walk w {a, b, lengths, blocks};
+  if (!result.empty())
+    w.fill(func, &a.root(), &b.root(), 0, result.data());
+  NTD_COUNT(elements_computed, w.computed);
+  NTD_SPAN_ARG(transform_span, "computed", w.computed);
+  return Sequence(std::move(result), std::move(lengths));
+}
+
+// An operand with a number for every element of the output, as when
+// neither has a number above the last level or a vector to cycle,
+// makes every pair distinct. Walking the Raw_Index then only costs
+// more, so that is left to the plain transpose_distribute.
+template <typename TF>
+Sequence transpose_distribute_unique(const Raw_Sequence& a, const Raw_Sequence& b, TF&& func) {
+  std::vector<int> lengths;
+  const std::uint64_t numbers = std::max(unique::numbers(a, lengths), unique::numbers(b, lengths));
+  std::uint64_t output {1};
+  for (int l : lengths) output *= std::uint64_t(l);
+  if (numbers >= output)
+    return transpose_distribute(a, b, std::forward<TF>(func));
+  return transpose_distribute_unique(Raw_Index(a), Raw_Index(b), std::forward<TF>(func));
+}
+
+#endif
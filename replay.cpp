@@ -0,0 +1,63 @@
+// Replay a capture log and report throughput and latency as JSON.
+//
+//   g++ -O2 -std=c++17 replay.cpp -pthread -o replay
+//   ./replay log [--threads n] [--repeat n]
+//
+// With several threads the calls are shared out between them, so the
+// log is replayed concurrently as it would be by a server.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "capture.hpp"
+#include "parallel.hpp"
+
+int main(int argc, char** argv) {
+  std::string path;
+  unsigned threads {1};
+  int repeat {1};
+  for (int i{1}; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--threads" && i+1 < argc) threads = std::atoi(argv[++i]);
+    else if (arg == "--repeat" && i+1 < argc) repeat = std::atoi(argv[++i]);
+    else if (path.empty() && arg[0] != '-') path = arg;
+    else path.clear(), i = argc;
+  }
+  if (path.empty() || threads < 1 || repeat < 1) {
+    std::cerr << "usage: " << argv[0] << " log [--threads n] [--repeat n]\n";
+    return 1;
+  }
+
+  using clock = std::chrono::steady_clock;
+  const auto calls = capture::read_log(path);
+  const std::size_t n = calls.size() * repeat;
+  std::vector<double> latency_ns (n);
+  std::vector<std::size_t> elements (n);
+
+  auto start = clock::now();
+  parallel_for(n, [&](std::size_t i) {
+    auto t = clock::now();
+    elements[i] = capture::replay(calls[i % calls.size()]);
+    latency_ns[i] = std::chrono::duration<double, std::nano>(clock::now() - t).count();
+  }, threads);
+  const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+  std::size_t total_elements {0};
+  for (auto e : elements) total_elements += e;
+  std::sort(latency_ns.begin(), latency_ns.end());
+  auto percentile = [&](double p) {
+    return n ? latency_ns[std::min(n - 1, std::size_t(p * n))] : 0.0;
+  };
+
+  std::cout << "{\"calls\": " << n
+            << ", \"threads\": " << threads
+            << ", \"seconds\": " << seconds
+            << ", \"calls_per_second\": " << n / seconds
+            << ", \"elements_per_second\": " << total_elements / seconds
+            << ", \"latency_ns\": {"
+            << "\"p50\": " << percentile(0.5)
+            << ", \"p90\": " << percentile(0.9)
+            << ", \"p99\": " << percentile(0.99)
+            << ", \"p999\": " << percentile(0.999)
+            << ", \"max\": " << (n ? latency_ns.back() : 0.0) << "}}\n";
+}
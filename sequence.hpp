@@ -1,3 +1,7 @@
+#ifndef H_SEQUENCE
+#define H_SEQUENCE
+
+#include <array>
 #include <vector>
 #include <numeric>
 #include <iostream>
@@ -6,7 +10,19 @@
 #include <variant>
 #include <iterator>
 #include <initializer_list>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+#include <stdexcept>
+#include <atomic>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+#include <cstdint>
+#include "constexpr.hpp"
 #include "prettyprint.hpp"
+#include "counters.hpp"
+#include "trace.hpp"
 
 // Helper for variant visting
 template<class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
@@ -30,144 +46,517 @@ namespace impl {
     Raw_Sequence data;
 
     template <typename... Ts>
-    wrapper(Ts&&... xs)
+    constexpr wrapper(Ts&&... xs)
       : data{std::forward<Ts>(xs)...} {}
   };
 
-  // Enable printing of a Raw_Sequence
-  std::ostream &operator<< (std::ostream &os, Raw_Sequence s) {
-    std::string seq_string{};
-    struct build_string {
-      std::string& str;
-      build_string (std::string& _str) : str(_str) {}
-      void operator() (int x) { str += std::to_string(x); }
-      void operator() (const vec& v) {
-        str += "[";
-        for (int i{0}; i < v.size(); ++i) {
-          visit_recursively(*this, v[i]);
-          if (i != v.size()-1) str += ", ";
-        }
-        str += "]";
+  // Writes text to a stream through a fixed buffer, formatting numbers
+  // with std::to_chars so printing never allocates.
+  class stream_writer {
+    std::ostream& os;
+    char buf[4096];
+    std::size_t n{0};
+  public:
+    explicit stream_writer(std::ostream& _os) : os(_os) {}
+    stream_writer(const stream_writer&) = delete;
+    ~stream_writer() { flush(); }
+
+    void flush() { os.write(buf, n); n = 0; }
+    void put(char c) {
+      if (n == sizeof buf) flush();
+      buf[n++] = c;
+    }
+    void put(std::string_view str) {
+      if (n + str.size() > sizeof buf) flush();
+      if (str.size() > sizeof buf) { os.write(str.data(), str.size()); return; }
+      std::memcpy(buf + n, str.data(), str.size());
+      n += str.size();
+    }
+    void put(int x) {
+      if (n + 11 > sizeof buf) flush();
+      n = std::to_chars(buf + n, buf + sizeof buf, x).ptr - buf;
+    }
+  };
+}
+
+// Summarisation of large outputs as in numpy: when there are more than
+// threshold elements, only the first and last edge_items of each vector
+// are printed.
+struct print_options {
+  bool summarise {false};
+  std::size_t threshold {1000};
+  int edge_items {3};
+};
+
+namespace impl {
+  std::size_t count_leaves(const Raw_Sequence& s) {
+    if (std::holds_alternative<int>(s)) return 1;
+    std::size_t n{0};
+    for (const auto& x : std::get<vec>(s))
+      n += count_leaves(x.data);
+    return n;
+  }
+
+  // Call f(i) for each index printed out of n, separated by ", " and
+  // with "..." in place of skipped indices.
+  template <typename F>
+  void print_indices(stream_writer& w, std::size_t n, int edge_items, F&& f) {
+    const bool skip = edge_items >= 0 && n > 2 * std::size_t(edge_items);
+    for (std::size_t i{0}; i < n; ++i) {
+      if (i != 0) w.put(", ");
+      if (skip && i == std::size_t(edge_items)) {
+        w.put("...");
+        i = n - edge_items - 1;
+        continue;
       }
-    };
-    std::visit(build_string(seq_string), s);
-    return os << seq_string;
+      f(i);
+    }
+  }
+
+  void print_elements(stream_writer& w, const Raw_Sequence& s, int edge_items) {
+    if (std::holds_alternative<int>(s)) {
+      w.put(std::get<int>(s));
+      return;
+    }
+    const auto& v = std::get<vec>(s);
+    w.put('[');
+    print_indices(w, v.size(), edge_items,
+        [&](std::size_t i) { print_elements(w, v[i].data, edge_items); });
+    w.put(']');
+  }
+
+  // Enable printing of a Raw_Sequence
+  std::ostream &operator<< (std::ostream &os, const Raw_Sequence& s) {
+    stream_writer w(os);
+    print_elements(w, s, -1);
+    return os;
   }
 }
+
 using impl::Raw_Sequence;
 using impl::vec;
 
-// Normalised Raw_Sequence data structure
-struct Sequence {
+void print(std::ostream& os, const Raw_Sequence& s, const print_options& opt = {}) {
+  impl::stream_writer w(os);
+  bool skip = opt.summarise && impl::count_leaves(s) > opt.threshold;
+  impl::print_elements(w, s, skip ? opt.edge_items : -1);
+}
+
+// Flat form of a Raw_Sequence. The leaves are stored in order in data
+// and the tree structure is stored in pre-order in nodes: a vector of
+// n elements is stored as n, a number as -1.
+struct Ragged_Sequence {
   std::vector<int> data;
-  std::vector<int> lengths;
-  Sequence() {}
-  Sequence(std::vector<int> d, std::vector<int> l)
-    : data{d}, lengths{l} {}
+  std::vector<int> nodes;
 };
 
-// NTD: Normalise Transpose Distribute
+void flatten_elements(Ragged_Sequence& r, const Raw_Sequence& s) {
+  if (std::holds_alternative<int>(s)) {
+    r.nodes.push_back(-1);
+    r.data.push_back(std::get<int>(s));
+    return;
+  }
+  const auto& v = std::get<vec>(s);
+  r.nodes.push_back(v.size());
+  for (const auto& x : v)
+    flatten_elements(r, x.data);
+}
 
-// Normalise the length of two containers by repeating elements
-// of the smaller container.
-template <typename T>
-constexpr void repeat_elements(T &a, int final_size) {
-  auto gen = [&](const auto& v, int& i) {
-    if (i == v.size()) i = 0;
-    return v.at(i++);
+Ragged_Sequence flatten(const Raw_Sequence& s) {
+  Ragged_Sequence r;
+  flatten_elements(r, s);
+  return r;
+}
+
+Raw_Sequence unflatten_elements(const Ragged_Sequence& r, int& node, int& leaf) {
+  int n = r.nodes.at(node++);
+  if (n < 0)
+    return r.data.at(leaf++);
+  vec v;
+  v.reserve(n);
+  for (int i{0}; i < n; ++i)
+    v.emplace_back(unflatten_elements(r, node, leaf));
+  return v;
+}
+
+Raw_Sequence to_raw(const Ragged_Sequence& r) {
+  int node{0}, leaf{0};
+  return unflatten_elements(r, node, leaf);
+}
+
+namespace impl {
+  void print_elements(stream_writer& w, const Ragged_Sequence& r, std::size_t& node, std::size_t& leaf) {
+    int n = r.nodes[node++];
+    if (n < 0) {
+      w.put(r.data[leaf++]);
+      return;
+    }
+    w.put('[');
+    for (int i{0}; i < n; ++i) {
+      if (i != 0) w.put(", ");
+      print_elements(w, r, node, leaf);
+    }
+    w.put(']');
+  }
+}
+
+std::ostream &operator<< (std::ostream &os, const Ragged_Sequence& r) {
+  impl::stream_writer w(os);
+  std::size_t node{0}, leaf{0};
+  impl::print_elements(w, r, node, leaf);
+  return os;
+}
+
+namespace impl {
+  // The lengths of a Basic_Sequence use the allocator of its container,
+  // if it has one
+  template <typename Container, typename = void>
+  struct lengths_type {
+    using type = std::vector<int>;
+  };
+  template <typename Container>
+  struct lengths_type<Container, std::void_t<typename Container::allocator_type>> {
+    using type = std::vector<int, typename std::allocator_traits<
+        typename Container::allocator_type>::template rebind_alloc<int>>;
   };
+}
+
+// Normalised Raw_Sequence data structure. Container holds the elements
+// and may be any contiguous container of int, such as a read-only view
+// of a mapped file or a std::pmr::vector.
+template <typename Container>
+struct Basic_Sequence {
+  using lengths_type = typename impl::lengths_type<Container>::type;
+  Container data;
+  lengths_type lengths;
+  constexpr Basic_Sequence() {}
+  constexpr Basic_Sequence(Container d, lengths_type l)
+    : data{std::move(d)}, lengths{std::move(l)} {}
+};
+using Sequence = Basic_Sequence<std::vector<int>>;
+using Pmr_Sequence = Basic_Sequence<std::pmr::vector<int>>;
 
-  auto norm = [&](auto& v, int n) {
-    int index{0};
-    auto g = std::bind(gen, v, index);
-    v.resize(v.size() + n);
-    std::generate(v.end()-n, v.end(), g);
+// Workload capture. With -DNTD_CAPTURE the outermost normalise and
+// transpose_distribute calls report their operands to the recorder
+// installed by capture::start in capture.hpp.
+namespace capture {
+  enum call {
+    normalise_raw,
+    normalise_sequence,
+    transpose_distribute_raw,
+    transpose_distribute_sequence
   };
 
-  int diff = final_size - a.size();
+  // A Raw_Sequence, a Sequence (data, size and lengths) or just lengths
+  struct operand {
+    const Raw_Sequence* raw {nullptr};
+    const int* data {nullptr};
+    std::size_t size {0};
+    const int* lengths {nullptr};
+    std::size_t rank {0};
+  };
 
-  if (diff <= 0)
+  using recorder_type = void (*)(call, std::initializer_list<operand>);
+  inline std::atomic<recorder_type> recorder {nullptr};
+
+  // Marks a captured call so the calls it makes are not captured too.
+  // Nothing is captured during constant evaluation.
+  class scope {
+    static int& depth() {
+      thread_local int d{0};
+      return d;
+    }
+    bool outer {false};
+  public:
+    constexpr scope() {
+      if (!__builtin_is_constant_evaluated()) outer = depth()++ == 0;
+    }
+    scope(const scope&) = delete;
+    NTD_CONSTEXPR ~scope() {
+#if __cpp_constexpr_dynamic_alloc >= 201907L
+      if (__builtin_is_constant_evaluated()) return;
+#endif
+      --depth();
+    }
+    bool outermost() const { return outer; }
+  };
+
+  template <typename Container>
+  operand sequence(const Basic_Sequence<Container>& s) {
+    return {nullptr, s.data.data(), s.data.size(), s.lengths.data(), s.lengths.size()};
+  }
+}
+
+#ifdef NTD_CAPTURE
+#define NTD_CAPTURE_CALL(kind, ...) \
+  capture::scope NTD_CONCAT(ntd_capture_, __LINE__); \
+  if (!__builtin_is_constant_evaluated()) \
+  if (auto r = capture::recorder.load(std::memory_order_acquire); \
+      r && NTD_CONCAT(ntd_capture_, __LINE__).outermost()) \
+    r(capture::kind, {__VA_ARGS__})
+#else
+#define NTD_CAPTURE_CALL(kind, ...) ((void)0)
+#endif
+
+namespace impl {
+  // Print the section of data starting at offset for level order,
+  // where block is the number of elements in the section.
+  template <typename Container>
+  void print_elements(stream_writer& w, const Basic_Sequence<Container>& s, std::size_t order,
+                      std::size_t offset, std::size_t block, int edge_items) {
+    if (order == s.lengths.size()) {
+      w.put(s.data[offset]);
+      return;
+    }
+    const std::size_t n = s.lengths[order];
+    const std::size_t sub_block = n ? block / n : 0;
+    w.put('[');
+    print_indices(w, n, edge_items, [&](std::size_t i) {
+      print_elements(w, s, order+1, offset + i*sub_block, sub_block, edge_items);
+    });
+    w.put(']');
+  }
+}
+
+// Print a Sequence with its nesting taken from lengths
+template <typename Container>
+void print(std::ostream& os, const Basic_Sequence<Container>& s, const print_options& opt = {}) {
+  impl::stream_writer w(os);
+  if (s.data.empty() && s.lengths.empty()) {
+    w.put("[]");
     return;
-  else if (diff > 0)
-    norm(a, diff);
+  }
+  bool skip = opt.summarise && s.data.size() > opt.threshold;
+  impl::print_elements(w, s, 0, 0, s.data.size(), skip ? opt.edge_items : -1);
 }
 
-// Repeat section of a from begin to end, inserting at position end.
-// final_size is final size between begin and end.
-template <typename T>
-constexpr void repeat_elements(T &a, int final_size, int begin, int end) {
-  auto gen = [&](const auto& v, int& i, int begin, int end) {
-    if (i == end) i = begin;
-    return v.at(i++);
+template <typename Container>
+std::ostream &operator<< (std::ostream &os, const Basic_Sequence<Container>& s) {
+  print(os, s);
+  return os;
+}
+
+// Denormalise: rebuild nested structure from data and lengths
+
+namespace impl {
+  template <typename Container>
+  Raw_Sequence denormalise_elements(const Basic_Sequence<Container>& s,
+      std::size_t order, std::size_t offset, std::size_t block) {
+    if (order == s.lengths.size())
+      return s.data[offset];
+    const std::size_t n = s.lengths[order];
+    const std::size_t sub_block = n ? block / n : 0;
+    vec v;
+    v.reserve(n);
+    for (std::size_t i{0}; i < n; ++i)
+      v.emplace_back(denormalise_elements(s, order+1, offset + i*sub_block, sub_block));
+    return v;
+  }
+
+  template <int Rank>
+  struct nested_vector {
+    using type = std::vector<typename nested_vector<Rank-1>::type>;
+  };
+  template <>
+  struct nested_vector<0> {
+    using type = int;
   };
 
-  auto norm = [&](auto& v, int n) {
-    int index{begin};
-    auto g = std::bind(gen, v, index, begin, end);
-    v.insert(v.begin()+end, n, 0);
-    std::generate(v.begin()+end, v.begin()+end+n, g);
+  template <int Rank, typename Container>
+  typename nested_vector<Rank>::type denormalise_elements(
+      const Basic_Sequence<Container>& s, std::size_t offset, std::size_t block) {
+    const std::size_t order = s.lengths.size() - Rank;
+    if constexpr (Rank == 0) {
+      return s.data[offset];
+    } else if constexpr (Rank == 1) {
+      return std::vector<int>(s.data.begin() + offset, s.data.begin() + offset + block);
+    } else {
+      const std::size_t n = s.lengths[order];
+      const std::size_t sub_block = n ? block / n : 0;
+      typename nested_vector<Rank>::type v;
+      v.reserve(n);
+      for (std::size_t i{0}; i < n; ++i)
+        v.push_back(denormalise_elements<Rank-1>(s, offset + i*sub_block, sub_block));
+      return v;
+    }
+  }
+}
+
+template <typename Container>
+Raw_Sequence denormalise(const Basic_Sequence<Container>& s) {
+  return impl::denormalise_elements(s, 0, 0, s.data.size());
+}
+
+// Denormalise into Rank nested std::vectors, e.g. for prettyprint.hpp
+template <int Rank, typename Container>
+typename impl::nested_vector<Rank>::type denormalise(const Basic_Sequence<Container>& s) {
+  if (s.lengths.size() != Rank)
+    throw std::invalid_argument("denormalise: rank does not match lengths");
+  return impl::denormalise_elements<Rank>(s, 0, s.data.size());
+}
+
+// Read-only nested view of a Sequence. Indexing walks down the levels
+// given by lengths and numbers are read straight from data, so nothing
+// is copied.
+template <typename Container>
+class nested_view {
+  const Basic_Sequence<Container>* s;
+  std::size_t order{0}, offset{0}, block{0};
+
+  nested_view(const Basic_Sequence<Container>* _s, std::size_t _order,
+              std::size_t _offset, std::size_t _block)
+    : s(_s), order(_order), offset(_offset), block(_block) {}
+public:
+  explicit nested_view(const Basic_Sequence<Container>& _s)
+    : s(&_s), block(_s.data.size()) {}
+
+  bool is_number() const { return order == s->lengths.size(); }
+  int value() const { return s->data[offset]; }
+  std::size_t size() const { return is_number() ? 0 : s->lengths[order]; }
+
+  nested_view operator[](std::size_t i) const {
+    const std::size_t sub_block = block / size();
+    return nested_view(s, order+1, offset + i*sub_block, sub_block);
+  }
+  nested_view at(std::size_t i) const {
+    if (i >= size()) throw std::out_of_range("nested_view::at");
+    return (*this)[i];
+  }
+
+  // The numbers under this view, which are contiguous in data
+  const int* begin() const { return &s->data[0] + offset; }
+  const int* end() const { return &s->data[0] + offset + block; }
+};
+
+// Access policies for the NTD engine. checked bounds checks every
+// access. unchecked validates shapes once on entry and then indexes
+// directly, keeping checks out of the per-element loops.
+struct checked {
+  static constexpr bool validate = false;
+  template <typename V>
+  static constexpr decltype(auto) at(V& v, std::size_t i) { return v.at(i); }
+  template <typename T, typename Variant>
+  static constexpr decltype(auto) get(Variant& v) { return std::get<T>(v); }
+};
+
+struct unchecked {
+  static constexpr bool validate = true;
+  template <typename V>
+  static constexpr decltype(auto) at(V& v, std::size_t i) { return v[i]; }
+  template <typename T, typename Variant>
+  static constexpr decltype(auto) get(Variant& v) { return *std::get_if<T>(&v); }
+};
+
+#ifdef NTD_UNCHECKED
+using default_policy = unchecked;
+#else
+using default_policy = checked;
+#endif
+
+namespace impl {
+  // unchecked, for lengths already known to fit the operands because
+  // they were taken from them
+  struct unchecked_valid : unchecked {
+    static constexpr bool validate = false;
   };
 
+  template <typename Policy> struct valid_shapes { using type = Policy; };
+  template <> struct valid_shapes<unchecked> { using type = unchecked_valid; };
+}
+
+// NTD: Normalise Transpose Distribute
+
+// Normalise the length of two containers by repeating elements
+// of the smaller container.
+template <typename Policy = default_policy, typename T>
+constexpr void repeat_elements(T &a, int final_size) {
+  const int n = a.size();
+  int diff = final_size - n;
+
+  if (diff <= 0)
+    return;
+  if (n == 0)
+    throw std::out_of_range("repeat_elements: nothing to repeat");
+  NTD_COUNT(elements_repeated, diff);
+  a.reserve(final_size);
+  for (int i{0}, j{0}; i < diff; ++i, ++j) {
+    if (j == n) j = 0;
+    a.push_back(std::as_const(Policy::at(a, j)));
+  }
+}
+
+// Repeat section of a from begin to end, inserting at position end.
+// final_size is final size between begin and end.
+template <typename Policy = default_policy, typename T>
+constexpr void repeat_elements(T &a, int final_size, int begin, int end) {
   int diff = final_size - (end-begin);
 
   if (diff <= 0)
     return;
-  else if (diff > 0)
-    norm(a, diff);
+  if (end == begin)
+    throw std::out_of_range("repeat_elements: nothing to repeat");
+  NTD_COUNT(elements_repeated, diff);
+  a.insert(a.begin()+end, diff, typename T::value_type{});
+  for (int i{0}, j{begin}; i < diff; ++i, ++j) {
+    if (j == end) j = begin;
+    Policy::at(a, end+i) = Policy::at(a, j);
+  }
 }
 
-void clone_elements(Raw_Sequence &s, int n) {
+NTD_CONSTEXPR void clone_elements(Raw_Sequence &s, int n) {
   if (n < 2) return;
+  NTD_COUNT(elements_repeated, n-1);
+  NTD_COUNT(allocations, 1);
   s = Raw_Sequence {vec (n, s)};
 }
 
 // Get the max length at each level/depth
-void get_length(std::vector<int>& lengths, int order, const Raw_Sequence s) {
+template <typename Policy = default_policy, typename Lengths>
+NTD_CONSTEXPR void get_length(Lengths& lengths, int order, const Raw_Sequence& s) {
+  NTD_COUNT(nodes_visited, 1);
+  NTD_COUNT(variant_dispatches, 1);
   if (std::holds_alternative<int>(s)) return;
   if (order > lengths.size()) lengths.push_back(0);
-  int n = std::get<vec>(s).size();
-  if (n > lengths.at(order-1))
-    lengths.at(order-1) = n;
-  for (auto& x : std::get<vec>(s))
-    get_length(lengths, order+1, x.data);
+  const auto& v = Policy::template get<vec>(s);
+  int n = v.size();
+  if (n > Policy::at(lengths, order-1))
+    Policy::at(lengths, order-1) = n;
+  for (auto& x : v)
+    get_length<Policy>(lengths, order+1, x.data);
 }
 
-std::vector<int> get_lengths(const Raw_Sequence s) {
+template <typename Policy = default_policy>
+NTD_CONSTEXPR std::vector<int> get_lengths(const Raw_Sequence& s) {
+  NTD_TIME(get_lengths);
+  NTD_SPAN(span, "get_lengths");
   std::vector<int> lengths {0};
-  get_length(lengths, 1, s);
+  get_length<Policy>(lengths, 1, s);
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "leaves", impl::count_leaves(s));
   return lengths;
 }
 
-std::vector<int> get_lengths(std::initializer_list<Raw_Sequence> l) {
-  std::vector<std::vector<int>> all_lengths {};
-
-  // Get the length vectors of each Raw_Sequence in the list and store them
-  std::transform(l.begin(), l.end(), std::back_inserter(all_lengths),
-      [](const Raw_Sequence s) -> std::vector<int> { return get_lengths(s); });
-
-  // Find the longest length vector
-  auto max_length_it = std::max_element(all_lengths.begin(), all_lengths.end(),
-      [](std::vector<int>& a, std::vector<int>& b) -> bool { 
-        return (a.size() < b.size()); 
-      });
-  int max_length = (*max_length_it).size();
-  
-  std::vector<int> lengths (max_length);
-
-  // Find the longest Raw_Sequence at each level
-  for (const auto& v : all_lengths) {
-    for (int i{0}; i < v.size(); ++i) {
-      if (v.at(i) > lengths.at(i))
-        lengths.at(i) = v.at(i);
-    }
-  }
+template <typename Policy = default_policy>
+NTD_CONSTEXPR std::vector<int> get_lengths(std::initializer_list<Raw_Sequence> l) {
+  NTD_TIME(get_lengths);
+  NTD_SPAN(span, "get_lengths");
+  NTD_SPAN_ARG(span, "inputs", l.size());
+  // Find the longest Raw_Sequence at each level, in one vector
+  std::vector<int> lengths {0};
+  for (const auto& s : l)
+    get_length<Policy>(lengths, 1, s);
+  NTD_SPAN_ARG(span, "rank", lengths.size());
   return lengths;
 }
 
-std::vector<int> get_lengths(std::initializer_list<Sequence> l) {
+template <typename Policy = default_policy>
+NTD_CONSTEXPR std::vector<int> get_lengths(std::initializer_list<Sequence> l) {
+  NTD_TIME(get_lengths);
+  NTD_SPAN(span, "get_lengths");
+  NTD_SPAN_ARG(span, "inputs", l.size());
   // Find the longest length vector
   auto max_length_it = std::max_element(l.begin(), l.end(),
-      [](Sequence a, Sequence b) -> bool { 
+      [](const Sequence& a, const Sequence& b) -> bool { 
         return (a.lengths.size() < b.lengths.size()); 
       });
   int max_length = (*max_length_it).lengths.size();
@@ -177,98 +566,447 @@ std::vector<int> get_lengths(std::initializer_list<Sequence> l) {
   // Find the longest Raw_Sequence at each level
   for (const auto& v : l) {
     for (int i{0}; i < v.lengths.size(); ++i) {
-      if (v.lengths.at(i) > lengths.at(i))
-        lengths.at(i) = v.lengths.at(i);
+      if (Policy::at(v.lengths, i) > Policy::at(lengths, i))
+        Policy::at(lengths, i) = Policy::at(v.lengths, i);
     }
   }
   return lengths;
 }
 
-void copy_elements(
-    std::vector<int>& norm_s, const std::vector<int>& lengths, int order, Raw_Sequence s, int& start_pos) {
-
-  bool done {false};
-  int n{0};
-
-  if (order > lengths.size()) {
-    // Must have reached a terminal vector
-    done = true;
-    n = 1;
-  } else {
-    // Make the current element the right length
-    // For a vector, repeat elements until have the required length
-    if (std::holds_alternative<vec>(s))
-      repeat_elements(std::get<vec>(s), lengths.at(order-1));
-    // For a number, just clone it to get required length
-    else {
-      n = std::accumulate( lengths.begin() + order-1,  lengths.end(),
-          1, std::multiplies<int>() );
-      clone_elements(s, n);
-      done = true;
-    }
+namespace impl {
+  // lengths can not hold a Raw_Sequence: out of range for checked, an
+  // invalid argument for the policies that validate on entry
+  template <typename Policy>
+  [[noreturn]] NTD_CONSTEXPR void too_small() {
+    if constexpr (Policy::validate)
+      throw std::invalid_argument("normalise: lengths too small for the Raw_Sequence");
+    else
+      throw std::out_of_range("normalise: lengths too small for the Raw_Sequence");
   }
+}
 
-  if (done) {
-    // Copy it across to the final vector
-    if (std::holds_alternative<vec>(s)) {
-      for (int i{0}; i < n; ++i) {
-        norm_s.at(start_pos+i) = std::get<int>( std::get<vec>(s).at(i).data );
-      }
-    } else {
-      norm_s.at(start_pos) = std::get<int>(s);
+// Write s normalised to lengths at norm_s[start_pos]. s is read in
+// place: a vector shorter than its level is cycled by index, and a
+// number is copied to every element of the block below it. Whether s
+// fits in lengths is checked here, once per vector, so no separate
+// pass over s is needed.
+template <typename Policy = default_policy>
+NTD_CONSTEXPR void copy_elements(std::vector<int>& norm_s, const std::vector<int>& lengths,
+                                 int order, const Raw_Sequence& s, int& start_pos) {
+  NTD_COUNT(nodes_visited, 1);
+  NTD_COUNT(variant_dispatches, 1);
+
+  if (const int* x = std::get_if<int>(&s)) {
+    const int n = order > int(lengths.size()) ? 1 : std::accumulate(
+        lengths.begin() + order-1, lengths.end(), 1, std::multiplies<int>());
+    if (n < 1)
+      throw std::out_of_range("normalise: lengths must be positive");
+    for (int i{0}; i < n; ++i)
+      Policy::at(norm_s, start_pos+i) = *x;
+    start_pos += n;
+    NTD_COUNT(elements_repeated, n-1);
+    NTD_COUNT(bytes_copied, n * sizeof(int));
+    return;
+  }
+
+  const auto& v = *std::get_if<vec>(&s);
+  if (order > int(lengths.size()))
+    impl::too_small<Policy>();
+  const int n = v.size();
+  const int length = Policy::at(lengths, order-1);
+  if (n > length)
+    impl::too_small<Policy>();
+  if (n == 0)
+    throw std::out_of_range("repeat_elements: nothing to repeat");
+  NTD_COUNT(elements_repeated, length - n);
+  for (int i{0}, j{0}; i < length; ++i, ++j) {
+    if (j == n) j = 0;
+    copy_elements<Policy>(norm_s, lengths, order+1, Policy::at(v, j).data, start_pos);
+  }
+}
+
+namespace impl {
+  template <typename Lengths>
+  NTD_CONSTEXPR void validate_positive(const Lengths& lengths) {
+    for (int l : lengths)
+      if (l < 1) throw std::invalid_argument("normalise: lengths must be positive");
+  }
+
+  // Check once that s fits in lengths, so the unchecked engine can
+  // index without bounds checks.
+  template <typename Lengths>
+  NTD_CONSTEXPR void validate_lengths(const Raw_Sequence& s, const Lengths& lengths) {
+    Lengths actual (1, 0, lengths.get_allocator());
+    get_length<checked>(actual, 1, s);
+    for (std::size_t i{0}; i < actual.size(); ++i)
+      if (actual[i] > (i < lengths.size() ? lengths[i] : 0))
+        throw std::invalid_argument("normalise: lengths too small for the Raw_Sequence");
+    validate_positive(lengths);
+  }
+
+  template <typename Container, typename Lengths>
+  NTD_CONSTEXPR void validate_lengths(const Basic_Sequence<Container>& s, const Lengths& lengths) {
+    std::size_t n {1};
+    for (int l : s.lengths) {
+      if (l < 1) throw std::invalid_argument("normalise: lengths must be positive");
+      n *= l;
     }
-    start_pos += n; 
-  } else {
-    for (auto& x : std::get<vec>(s))
-      copy_elements(norm_s, lengths, order+1, x.data, start_pos);
+    if (n != s.data.size())
+      throw std::invalid_argument("normalise: data size does not match lengths");
+    validate_positive(lengths);
   }
 }
 
-Sequence normalise(Raw_Sequence s, std::vector<int> lengths) {
+// Under unchecked only the lengths are validated on entry; copy_elements
+// checks that s fits them as it goes.
+template <typename Policy = default_policy>
+NTD_CONSTEXPR Sequence normalise(const Raw_Sequence& s, std::vector<int> lengths) {
+  NTD_TIME(normalise_raw);
+  NTD_SPAN(span, "normalise");
+  NTD_CAPTURE_CALL(normalise_raw, {&s}, {nullptr, nullptr, 0, lengths.data(), lengths.size()});
+  if constexpr (Policy::validate) impl::validate_positive(lengths);
   std::vector<int> norm_s ( std::accumulate(
         lengths.begin(), lengths.end(), 1, std::multiplies<int>()) );
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "leaves", impl::count_leaves(s));
+  NTD_SPAN_ARG(span, "output", norm_s.size());
+  NTD_COUNT(allocations, 1);
   int start_pos {0};
-  copy_elements(norm_s, lengths, 1, s, start_pos);
-  return Sequence(norm_s, lengths);
+  copy_elements<Policy>(norm_s, lengths, 1, s, start_pos);
+  return Sequence(std::move(norm_s), std::move(lengths));
 }
 
-Sequence normalise(Sequence s, std::vector<int> lengths) {
-  int diff = lengths.size() - s.lengths.size();
-  if (diff > 0) {
-    s.lengths.insert(s.lengths.begin(), diff, 1);
-  }
+namespace impl {
+  // Normalise s in place by repeating the sections of each level that
+  // is shorter than lengths, from the last level up
+  template <typename Policy, typename Container, typename Lengths>
+  NTD_CONSTEXPR void repeat_sections(Basic_Sequence<Container>& s, const Lengths& lengths) {
+    int diff = lengths.size() - s.lengths.size();
+    if (diff > 0) {
+      s.lengths.insert(s.lengths.begin(), diff, 1);
+    }
 
-  for (int order{int(lengths.size()-1)}; order >= 0; --order) {
-    const int n = s.data.size();
-    int old_section_length = std::accumulate( 
-      s.lengths.begin() + order, s.lengths.end(), 1, std::multiplies<int>() );
-    int new_section_length = std::accumulate( 
-      lengths.begin() + order, lengths.end(), 1, std::multiplies<int>() );
-    int begin{0}, end{old_section_length};
+    for (int order{int(lengths.size()-1)}; order >= 0; --order) {
+      const int n = s.data.size();
+      int old_section_length = std::accumulate( 
+        s.lengths.begin() + order, s.lengths.end(), 1, std::multiplies<int>() );
+      int new_section_length = std::accumulate( 
+        lengths.begin() + order, lengths.end(), 1, std::multiplies<int>() );
+      int begin{0}, end{old_section_length};
 
-    if (s.lengths.at(order) < lengths.at(order)) {
-      for (int i{0}; i < n / old_section_length; ++i) {
-        repeat_elements(s.data, new_section_length, begin, end);
-        begin += new_section_length;
-        end += new_section_length;
+      if (Policy::at(s.lengths, order) < Policy::at(lengths, order)) {
+        NTD_COUNT(allocations, 1);
+        for (int i{0}; i < n / old_section_length; ++i) {
+          repeat_elements<Policy>(s.data, new_section_length, begin, end);
+          begin += new_section_length;
+          end += new_section_length;
+        }
+        Policy::at(s.lengths, order) = Policy::at(lengths, order);
       }
-      s.lengths.at(order) = lengths.at(order);
     }
   }
+}
+
+template <typename Policy = default_policy>
+NTD_CONSTEXPR Sequence normalise(Sequence s, std::vector<int> lengths) {
+  NTD_TIME(normalise_sequence);
+  NTD_SPAN(span, "normalise");
+  NTD_CAPTURE_CALL(normalise_sequence, capture::sequence(s), {nullptr, nullptr, 0, lengths.data(), lengths.size()});
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "leaves", s.data.size());
+  if constexpr (Policy::validate) impl::validate_lengths(s, lengths);
+  if (s.lengths == lengths) {
+    NTD_SPAN_ARG(span, "output", s.data.size());
+    return s;
+  }
+  impl::repeat_sections<Policy>(s, lengths);
+  NTD_SPAN_ARG(span, "output", s.data.size());
   return s;
 }
 
+template <typename Policy = default_policy, typename Container>
+NTD_CONSTEXPR Sequence normalise(const Basic_Sequence<Container>& s, std::vector<int> lengths) {
+  return normalise<Policy>(
+      Sequence({s.data.begin(), s.data.end()}, {s.lengths.begin(), s.lengths.end()}), lengths);
+}
+
+namespace impl {
+  template <typename Alloc>
+  using int_vector = std::vector<int,
+      typename std::allocator_traits<Alloc>::template rebind_alloc<int>>;
+
+  // Longest length at each level of a and b
+  template <typename Policy, typename Lengths, typename LA, typename LB>
+  NTD_CONSTEXPR void merge_lengths(Lengths& lengths, const LA& a, const LB& b) {
+    lengths.assign(std::max(a.size(), b.size()), 0);
+    for (std::size_t i{0}; i < a.size(); ++i)
+      Policy::at(lengths, i) = Policy::at(a, i);
+    for (std::size_t i{0}; i < b.size(); ++i)
+      Policy::at(lengths, i) = std::max(Policy::at(lengths, i), Policy::at(b, i));
+  }
+
+  // The normalised operands of a transform must each hold every
+  // element of lengths. This is checked under every policy, as
+  // std::transform reads them through iterators, not Policy::at.
+  template <typename DA, typename DB, typename Lengths>
+  NTD_CONSTEXPR void check_normalised_sizes(const DA& da, const DB& db, const Lengths& lengths) {
+    std::uint64_t n {1};
+    for (int l : lengths)
+      n *= std::uint64_t(std::max(l, 0));
+    if (da.size() != n || db.size() != n)
+      throw std::invalid_argument("transpose_distribute: data size does not match lengths");
+  }
+
+  // compute on the data of a and b normalised to lengths. An operand
+  // that already has those lengths is read in place, so views such as
+  // a mapped file are only copied when they need repeating.
+  // normalise(s) gives s normalised to lengths.
+  template <typename CA, typename CB, typename Lengths, typename Normalise, typename Compute>
+  NTD_CONSTEXPR auto with_normalised(const Basic_Sequence<CA>& a, const Basic_Sequence<CB>& b,
+                                     const Lengths& lengths, Normalise&& normalise,
+                                     Compute&& compute) {
+    const bool a_done = std::equal(a.lengths.begin(), a.lengths.end(),
+                                   lengths.begin(), lengths.end());
+    const bool b_done = std::equal(b.lengths.begin(), b.lengths.end(),
+                                   lengths.begin(), lengths.end());
+    if (a_done && b_done)
+      return compute(a.data, b.data);
+    if (a_done)
+      return compute(a.data, normalise(b).data);
+    if (b_done)
+      return compute(normalise(a).data, b.data);
+    return compute(normalise(a).data, normalise(b).data);
+  }
+
+  // Lengths and block sizes to normalise a Raw_Sequence to, for
+  // copy_elements_in_place
+  template <typename Lengths>
+  struct in_place_shape {
+    const Lengths& lengths;
+    Lengths blocks;
+  };
+
+  template <typename Lengths>
+  NTD_CONSTEXPR in_place_shape<Lengths> make_in_place_shape(const Lengths& lengths) {
+    in_place_shape<Lengths> sh {lengths, Lengths(lengths.size()+1, 1, lengths.get_allocator())};
+    for (std::size_t order{lengths.size()}; order > 0; --order)
+      sh.blocks[order-1] = sh.blocks[order] * lengths[order-1];
+    return sh;
+  }
+
+  // Write s normalised to the lengths of sh at out[pos], as
+  // copy_elements does but reading s in place. sh.blocks[i] is the
+  // number of elements in a block at level i, and sh.lengths must fit s.
+  template <typename Shape>
+  NTD_CONSTEXPR void copy_elements_in_place(const Shape& sh, const Raw_Sequence& s, int order,
+                                            int* out, int& pos) {
+    NTD_COUNT(nodes_visited, 1);
+    NTD_COUNT(variant_dispatches, 1);
+    if (const int* x = std::get_if<int>(&s)) {
+      const int n = sh.blocks[order-1];
+      for (int i{0}; i < n; ++i)
+        out[pos+i] = *x;
+      pos += n;
+      NTD_COUNT(elements_repeated, n-1);
+      NTD_COUNT(bytes_copied, n * sizeof(int));
+      return;
+    }
+    const auto& v = *std::get_if<vec>(&s);
+    const int n = v.size();
+    const int length = sh.lengths[order-1];
+    if (n == 0)
+      throw std::out_of_range("repeat_elements: nothing to repeat");
+    NTD_COUNT(elements_repeated, length - n);
+    for (int i{0}, j{0}; i < length; ++i, ++j) {
+      if (j == n) j = 0;
+      copy_elements_in_place(sh, v[j].data, order+1, out, pos);
+    }
+  }
+
+  // Tiny operands of transpose_distribute, which most calls have, are
+  // normalised into buffers on the stack. The path still allocates the
+  // data and lengths of the Sequence it returns, as those are the
+  // std::vectors callers use; that is all it allocates.
+  namespace small {
+    constexpr int max_rank {3};
+    constexpr int max_leaves {32};
+    constexpr int max_elements {256};
+
+    struct shape {
+      std::array<int, max_rank> lengths {};
+      // Number of elements in a block at each level
+      std::array<int, max_rank+1> blocks {};
+      int rank {0};
+      int leaves {0};
+    };
+
+    // Add the lengths of s to sh, false if s is too big for this path
+    NTD_CONSTEXPR bool add_lengths(shape& sh, const Raw_Sequence& s, int order) {
+      NTD_COUNT(nodes_visited, 1);
+      NTD_COUNT(variant_dispatches, 1);
+      if (std::holds_alternative<int>(s))
+        return ++sh.leaves <= max_leaves;
+      if (order > max_rank)
+        return false;
+      const auto& v = *std::get_if<vec>(&s);
+      sh.rank = std::max(sh.rank, order);
+      sh.lengths[order-1] = std::max<int>(sh.lengths[order-1], v.size());
+      for (const auto& x : v)
+        if (!add_lengths(sh, x.data, order+1)) return false;
+      return true;
+    }
+
+    // Result of transpose_distribute in result, if a and b are small
+    template <typename TF>
+    NTD_CONSTEXPR bool transpose_distribute(
+        const Raw_Sequence& a, const Raw_Sequence& b, TF& func, Sequence& result) {
+      if (!std::holds_alternative<vec>(a) || !std::holds_alternative<vec>(b))
+        return false;
+      shape sh;
+      {
+        NTD_TIME(get_lengths);
+        NTD_SPAN(span, "get_lengths");
+        if (!add_lengths(sh, a, 1)) return false;
+        sh.leaves = 0;
+        if (!add_lengths(sh, b, 1)) return false;
+        sh.blocks[sh.rank] = 1;
+        for (int order{sh.rank}; order > 0; --order)
+          sh.blocks[order-1] = sh.blocks[order] * sh.lengths[order-1];
+        NTD_SPAN_ARG(span, "rank", sh.rank);
+      }
+      const int n = sh.blocks[0];
+      if (n < 1 || n > max_elements)
+        return false;
+
+      int norm_a[max_elements], norm_b[max_elements];
+      for (auto [s, out] : {std::pair{&a, norm_a}, std::pair{&b, norm_b}}) {
+        NTD_TIME(normalise_raw);
+        NTD_SPAN(span, "normalise");
+        NTD_SPAN_ARG(span, "rank", sh.rank);
+        NTD_SPAN_ARG(span, "output", n);
+        int pos {0};
+        copy_elements_in_place(sh, *s, 1, out, pos);
+      }
+
+      NTD_TIME(transform);
+      NTD_SPAN(span, "transform");
+      NTD_SPAN_ARG(span, "output", n);
+      NTD_COUNT(allocations, 2);
+      NTD_COUNT(elements_computed, n);
+      result.data.resize(n);
+      std::transform(norm_a, norm_a + n, norm_b, result.data.begin(), func);
+      result.lengths.assign(sh.lengths.begin(), sh.lengths.begin() + sh.rank);
+      return true;
+    }
+  }
+
+  // Operands that are already rectangular and of the same lengths need
+  // no normalising: their numbers in order are the normalised data.
+  namespace same_shape {
+    // Lengths of s along its first elements
+    NTD_CONSTEXPR std::vector<int> first_lengths(const Raw_Sequence& s) {
+      std::vector<int> lengths;
+      for (const Raw_Sequence* x = &s; const vec* v = std::get_if<vec>(x); x = &(*v)[0].data) {
+        lengths.push_back(v->size());
+        if (v->empty()) break;
+      }
+      return lengths;
+    }
+
+    // Append the numbers of a and b to out_a and out_b, false as soon
+    // as either is not rectangular with lengths
+    NTD_CONSTEXPR bool gather(const Raw_Sequence& a, const Raw_Sequence& b,
+                              const std::vector<int>& lengths, std::size_t order,
+                              std::vector<int>& out_a, std::vector<int>& out_b) {
+      NTD_COUNT(nodes_visited, 2);
+      NTD_COUNT(variant_dispatches, 2);
+      if (order == lengths.size()) {
+        const int* x = std::get_if<int>(&a);
+        const int* y = std::get_if<int>(&b);
+        if (!x || !y) return false;
+        out_a.push_back(*x);
+        out_b.push_back(*y);
+        return true;
+      }
+      const vec* x = std::get_if<vec>(&a);
+      const vec* y = std::get_if<vec>(&b);
+      // Positive, as transpose_distribute checks n first
+      const std::size_t n = lengths[order];
+      if (!x || !y || x->size() != n || y->size() != n)
+        return false;
+      for (std::size_t i{0}; i < x->size(); ++i)
+        if (!gather((*x)[i].data, (*y)[i].data, lengths, order+1, out_a, out_b))
+          return false;
+      return true;
+    }
+
+    // Result of transpose_distribute in result, if a and b have the
+    // same rectangular shape. func is not called otherwise.
+    template <typename TF>
+    NTD_CONSTEXPR bool transpose_distribute(
+        const Raw_Sequence& a, const Raw_Sequence& b, TF& func, Sequence& result) {
+      std::vector<int> lengths = first_lengths(a);
+      if (lengths.empty() || lengths != first_lengths(b))
+        return false;
+      const std::size_t n = std::accumulate(
+          lengths.begin(), lengths.end(), std::size_t(1), std::multiplies<std::size_t>());
+      if (n == 0)
+        return false;
+
+      std::vector<int> data, other;
+      {
+        NTD_TIME(normalise_raw);
+        data.reserve(n);
+        other.reserve(n);
+        NTD_COUNT(allocations, 2);
+        if (!gather(a, b, lengths, 0, data, other))
+          return false;
+      }
+
+      NTD_TIME(transform);
+      NTD_SPAN(span, "transform");
+      NTD_SPAN_ARG(span, "output", data.size());
+      NTD_COUNT(elements_computed, data.size());
+      std::transform(data.begin(), data.end(), other.begin(), data.begin(), func);
+      result = Sequence(std::move(data), std::move(lengths));
+      return true;
+    }
+  }
+}
+
 // Pass functions using template params for now,
 // maybe change to function_view from here later.
 // https://vittorioromeo.info/index/blog/passing_functions_to_functions.htm
-template <typename TF>
-Sequence transpose_distribute(Raw_Sequence a, Raw_Sequence b, TF&& func) {
+template <typename Policy = default_policy, typename TF>
+NTD_CONSTEXPR Sequence transpose_distribute(
+    const Raw_Sequence& a, const Raw_Sequence& b, TF&& func) {
+  // The lengths come from the operands, so they fit both; they are
+  // only checked once for a level with nothing to repeat
+  using Engine = typename impl::valid_shapes<Policy>::type;
+  NTD_SPAN(span, "transpose_distribute");
+  NTD_CAPTURE_CALL(transpose_distribute_raw, {&a}, {&b});
+  Sequence fast;
+  if (impl::small::transpose_distribute(a, b, func, fast)
+      || impl::same_shape::transpose_distribute(a, b, func, fast)) {
+    NTD_SPAN_ARG(span, "rank", fast.lengths.size());
+    NTD_SPAN_ARG(span, "output", fast.data.size());
+    return fast;
+  }
+
   // normalise
-  auto lengths = get_lengths({a,b});
-  Sequence norm_a = normalise(a, lengths);
-  Sequence norm_b = normalise(b, lengths);
+  auto lengths = get_lengths<Engine>({a,b});
+  if constexpr (Policy::validate) impl::validate_positive(lengths);
+  Sequence norm_a = normalise<Engine>(a, lengths);
+  Sequence norm_b = normalise<Engine>(b, lengths);
 
+  NTD_TIME(transform);
+  NTD_SPAN(transform_span, "transform");
   std::vector<int> result (norm_a.data.size());
+  NTD_COUNT(allocations, 1);
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "output", result.size());
+  NTD_SPAN_ARG(transform_span, "output", result.size());
+  NTD_COUNT(elements_computed, result.size());
 
   std::transform(
       norm_a.data.begin(), 
@@ -278,9 +1016,162 @@ Sequence transpose_distribute(Raw_Sequence a, Raw_Sequence b, TF&& func) {
       func
       );
 
-  return Sequence(result, lengths);
+  return Sequence(std::move(result), std::move(lengths));
+}
+
+// Operands that already have the final lengths are read in place, so
+// views such as a mapped file are only copied when they need repeating.
+template <typename Policy = default_policy, typename CA, typename CB, typename TF>
+NTD_CONSTEXPR Sequence transpose_distribute(
+    const Basic_Sequence<CA>& a, const Basic_Sequence<CB>& b, TF&& func) {
+  NTD_SPAN(span, "transpose_distribute");
+  NTD_CAPTURE_CALL(transpose_distribute_sequence, capture::sequence(a), capture::sequence(b));
+  std::vector<int> lengths;
+  impl::merge_lengths<Policy>(lengths, a.lengths, b.lengths);
+
+  return impl::with_normalised(a, b, lengths,
+      [&](const auto& s) { return normalise<Policy>(s, lengths); },
+      [&](const auto& da, const auto& db) {
+        NTD_TIME(transform);
+        NTD_SPAN(transform_span, "transform");
+        impl::check_normalised_sizes(da, db, lengths);
+        std::vector<int> result (da.size());
+        NTD_COUNT(allocations, 1);
+        NTD_SPAN_ARG(span, "rank", lengths.size());
+        NTD_SPAN_ARG(span, "output", result.size());
+        NTD_SPAN_ARG(transform_span, "output", result.size());
+        NTD_COUNT(elements_computed, result.size());
+        std::transform(da.begin(), da.end(), db.begin(), result.begin(), func);
+        return Sequence(std::move(result), lengths);
+      });
+}
+
+// With an allocator, the result and every buffer the call needs come
+// from alloc, e.g. a std::pmr::polymorphic_allocator over an arena.
+// Raw_Sequence operands are read in place rather than copied and grown,
+// so no nodes are allocated either. The lengths are always checked.
+template <typename Policy = default_policy, typename Alloc, typename Lengths = std::vector<int>>
+NTD_CONSTEXPR Basic_Sequence<impl::int_vector<Alloc>> normalise(
+    const Raw_Sequence& s, const Lengths& lengths, const Alloc& alloc) {
+  NTD_TIME(normalise_raw);
+  NTD_SPAN(span, "normalise");
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  impl::int_vector<Alloc> l (lengths.begin(), lengths.end(), alloc);
+  impl::validate_lengths(s, l);
+  auto sh = impl::make_in_place_shape(l);
+  impl::int_vector<Alloc> data (sh.blocks[0], alloc);
+  NTD_COUNT(allocations, 1);
+  int pos {0};
+  impl::copy_elements_in_place(sh, s, 1, data.data(), pos);
+  NTD_SPAN_ARG(span, "output", data.size());
+  return {std::move(data), std::move(l)};
+}
+
+template <typename Policy = default_policy, typename Container, typename Alloc,
+          typename Lengths = std::vector<int>>
+NTD_CONSTEXPR Basic_Sequence<impl::int_vector<Alloc>> normalise(
+    const Basic_Sequence<Container>& s, const Lengths& lengths, const Alloc& alloc) {
+  NTD_TIME(normalise_sequence);
+  NTD_SPAN(span, "normalise");
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "leaves", s.data.size());
+  Basic_Sequence<impl::int_vector<Alloc>> r (
+      {s.data.begin(), s.data.end(), alloc}, {s.lengths.begin(), s.lengths.end(), alloc});
+  if constexpr (Policy::validate) impl::validate_lengths(r, lengths);
+  impl::repeat_sections<Policy>(r, lengths);
+  NTD_SPAN_ARG(span, "output", r.data.size());
+  return r;
+}
+
+template <typename Policy = default_policy, typename TF, typename Alloc>
+NTD_CONSTEXPR Basic_Sequence<impl::int_vector<Alloc>> transpose_distribute(
+    const Raw_Sequence& a, const Raw_Sequence& b, TF&& func, const Alloc& alloc) {
+  NTD_SPAN(span, "transpose_distribute");
+  impl::int_vector<Alloc> lengths (1, 0, alloc);
+  {
+    NTD_TIME(get_lengths);
+    NTD_SPAN(lengths_span, "get_lengths");
+    get_length<Policy>(lengths, 1, a);
+    get_length<Policy>(lengths, 1, b);
+    NTD_SPAN_ARG(lengths_span, "rank", lengths.size());
+  }
+  auto sh = impl::make_in_place_shape(lengths);
+  const int n = sh.blocks[0];
+  impl::int_vector<Alloc> norm_a (n, alloc), norm_b (n, alloc);
+  NTD_COUNT(allocations, 2);
+  for (auto [s, out] : {std::pair{&a, norm_a.data()}, std::pair{&b, norm_b.data()}}) {
+    NTD_TIME(normalise_raw);
+    NTD_SPAN(normalise_span, "normalise");
+    NTD_SPAN_ARG(normalise_span, "output", n);
+    int pos {0};
+    impl::copy_elements_in_place(sh, *s, 1, out, pos);
+  }
+
+  // The result overwrites norm_a
+  NTD_TIME(transform);
+  NTD_SPAN(transform_span, "transform");
+  NTD_SPAN_ARG(span, "rank", lengths.size());
+  NTD_SPAN_ARG(span, "output", n);
+  NTD_SPAN_ARG(transform_span, "output", n);
+  NTD_COUNT(elements_computed, n);
+  std::transform(norm_a.begin(), norm_a.end(), norm_b.begin(), norm_a.begin(), func);
+  return {std::move(norm_a), std::move(lengths)};
+}
+
+template <typename Policy = default_policy, typename CA, typename CB, typename TF, typename Alloc>
+NTD_CONSTEXPR Basic_Sequence<impl::int_vector<Alloc>> transpose_distribute(
+    const Basic_Sequence<CA>& a, const Basic_Sequence<CB>& b, TF&& func, const Alloc& alloc) {
+  NTD_SPAN(span, "transpose_distribute");
+  impl::int_vector<Alloc> lengths (alloc);
+  impl::merge_lengths<Policy>(lengths, a.lengths, b.lengths);
+
+  return impl::with_normalised(a, b, lengths,
+      [&](const auto& s) { return normalise<Policy>(s, lengths, alloc); },
+      [&](const auto& da, const auto& db) {
+        NTD_TIME(transform);
+        NTD_SPAN(transform_span, "transform");
+        impl::check_normalised_sizes(da, db, lengths);
+        impl::int_vector<Alloc> result (da.size(), alloc);
+        NTD_COUNT(allocations, 1);
+        NTD_SPAN_ARG(span, "rank", lengths.size());
+        NTD_SPAN_ARG(span, "output", result.size());
+        NTD_SPAN_ARG(transform_span, "output", result.size());
+        NTD_COUNT(elements_computed, result.size());
+        std::transform(da.begin(), da.end(), db.begin(), result.begin(), func);
+        return Basic_Sequence<impl::int_vector<Alloc>>(std::move(result), lengths);
+      });
 }
 
+#if __cpp_constexpr_dynamic_alloc >= 201907L && __cpp_consteval >= 201811L
+// A Sequence worked out at compile time, kept in static storage
+template <std::size_t N, std::size_t Rank>
+struct Static_Sequence {
+  std::array<int, N> data;
+  std::array<int, Rank> lengths;
+
+  Sequence sequence() const {
+    return {{data.begin(), data.end()}, {lengths.begin(), lengths.end()}};
+  }
+};
+
+// Run f, a lambda without captures returning a Sequence, in constant
+// evaluation and keep the result, so tables are built into the binary
+// rather than at startup:
+//   constexpr auto table = static_sequence([] {
+//     return transpose_distribute(vec{1,2,3}, vec{vec{1,2},3}, std::plus<int>());
+//   });
+template <typename F>
+consteval auto static_sequence(F) {
+  constexpr std::size_t n = F{}().data.size();
+  constexpr std::size_t rank = F{}().lengths.size();
+  const Sequence s = F{}();
+  Static_Sequence<n, rank> result {};
+  std::copy(s.data.begin(), s.data.end(), result.data.begin());
+  std::copy(s.lengths.begin(), s.lengths.end(), result.lengths.begin());
+  return result;
+}
+#endif
+
 /* Functions.
  * For example a function with this signature: my_func := (scalar x, vector y)
  * will be like
@@ -330,3 +1221,5 @@ Sequence transpose_distribute(std::initializer_list<Raw_Sequence> l, TF&& func)
   return Sequence(result, lengths);
 }
 */
+
+#endif
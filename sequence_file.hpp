@@ -0,0 +1,177 @@
+#ifndef H_SEQUENCE_FILE
+#define H_SEQUENCE_FILE
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include "mapped_file.hpp"
+#include "sequence.hpp"
+
+// Binary Sequence files
+//
+// Layout (native little-endian):
+//   header     magic "NTDS", version, element type, rank,
+//              element count, offset of data
+//   lengths    rank x int32
+//   padding    zeros up to the data offset, a multiple of 64
+//   data       element count x int32
+//
+// A loaded file is memory-mapped and exposed as a read-only view, so
+// no elements are copied and every process loading the same file
+// shares the page cache.
+namespace sequence_file {
+  static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+                "sequence files are little-endian");
+
+  constexpr char magic[4] {'N','T','D','S'};
+  constexpr std::uint32_t version {1};
+  constexpr std::uint32_t int32_type {1};
+  constexpr std::uint64_t alignment {64};
+
+  struct header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint32_t element_type;
+    std::uint32_t rank;
+    std::uint64_t count;
+    std::uint64_t data_offset;
+  };
+  static_assert(sizeof(header) == 32);
+
+  [[noreturn]] inline void error(const std::string& path, const char* what) {
+    throw std::runtime_error(path + ": " + what);
+  }
+}
+
+// Read-only contiguous view of the elements of a mapped file. Copies
+// share the mapping, which is released with the last of them.
+class mapped_array {
+  std::shared_ptr<const mapped_file> file;
+  const int* first {nullptr};
+  std::size_t n {0};
+public:
+  using value_type = int;
+  using const_iterator = const int*;
+  using iterator = const_iterator;
+
+  mapped_array() {}
+  mapped_array(std::shared_ptr<const mapped_file> f, const int* d, std::size_t size)
+    : file{std::move(f)}, first{d}, n{size} {}
+
+  std::size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  const int* data() const { return first; }
+  const_iterator begin() const { return first; }
+  const_iterator end() const { return first + n; }
+  const int& operator[](std::size_t i) const { return first[i]; }
+  const int& at(std::size_t i) const {
+    if (i >= n) throw std::out_of_range("mapped_array::at");
+    return first[i];
+  }
+};
+
+using Mapped_Sequence = Basic_Sequence<mapped_array>;
+
+template <typename Container>
+void save(const Basic_Sequence<Container>& s, const std::string& path) {
+  using namespace sequence_file;
+  header h {};
+  std::copy(std::begin(magic), std::end(magic), h.magic);
+  h.version = version;
+  h.element_type = int32_type;
+  h.rank = s.lengths.size();
+  h.count = s.data.size();
+  std::uint64_t offset = sizeof h + s.lengths.size() * sizeof(int);
+  h.data_offset = (offset + alignment - 1) / alignment * alignment;
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) error(path, "cannot open for writing");
+  const char padding[alignment] {};
+  out.write(reinterpret_cast<const char*>(&h), sizeof h);
+  out.write(reinterpret_cast<const char*>(s.lengths.data()), s.lengths.size() * sizeof(int));
+  out.write(padding, h.data_offset - offset);
+  out.write(reinterpret_cast<const char*>(s.data.data()), s.data.size() * sizeof(int));
+  if (!out.flush()) error(path, "write failed");
+}
+
+// Sequence file written a chunk at a time, for results too big to keep
+// in memory. The header and lengths are written up front; the elements
+// are appended in order by calling the writer, and close checks they
+// all arrived.
+class sequence_file_writer {
+  std::string path;
+  std::ofstream out;
+  std::uint64_t count {0};
+  std::uint64_t expected {0};
+public:
+  sequence_file_writer(const std::string& p, const std::vector<int>& lengths) : path{p} {
+    using namespace sequence_file;
+    expected = 1;
+    for (int l : lengths) expected *= std::uint64_t(std::max(l, 0));
+    header h {};
+    std::copy(std::begin(magic), std::end(magic), h.magic);
+    h.version = version;
+    h.element_type = int32_type;
+    h.rank = lengths.size();
+    h.count = expected;
+    std::uint64_t offset = sizeof h + lengths.size() * sizeof(int);
+    h.data_offset = (offset + alignment - 1) / alignment * alignment;
+
+    out.open(path, std::ios::binary | std::ios::trunc);
+    if (!out) error(path, "cannot open for writing");
+    const char padding[alignment] {};
+    out.write(reinterpret_cast<const char*>(&h), sizeof h);
+    out.write(reinterpret_cast<const char*>(lengths.data()), lengths.size() * sizeof(int));
+    out.write(padding, h.data_offset - offset);
+  }
+
+  void operator()(const int* data, std::size_t n) {
+    if (n > expected - count) sequence_file::error(path, "more elements than the lengths");
+    out.write(reinterpret_cast<const char*>(data), n * sizeof(int));
+    count += n;
+  }
+
+  void close() {
+    if (count != expected) sequence_file::error(path, "fewer elements than the lengths");
+    if (!out.flush()) sequence_file::error(path, "write failed");
+    out.close();
+  }
+};
+
+Mapped_Sequence load(const std::string& path) {
+  using namespace sequence_file;
+  auto file = std::make_shared<const mapped_file>(path);
+
+  header h;
+  if (file->size < sizeof h) error(path, "not a sequence file");
+  std::memcpy(&h, file->data, sizeof h);
+  if (!std::equal(std::begin(magic), std::end(magic), h.magic))
+    error(path, "not a sequence file");
+  if (h.version != version) error(path, "unsupported version");
+  if (h.element_type != int32_type) error(path, "unsupported element type");
+  if (h.data_offset % alignment != 0
+      || h.data_offset < sizeof h + std::uint64_t(h.rank) * sizeof(int)
+      || h.data_offset > file->size
+      || h.count > (file->size - h.data_offset) / sizeof(int))
+    error(path, "truncated or corrupt");
+
+  std::vector<int> lengths (h.rank);
+  std::memcpy(lengths.data(), file->data + sizeof h, h.rank * sizeof(int));
+  // As impl::validate_lengths, and the product can not pass count, so
+  // it can not overflow
+  std::uint64_t n {1};
+  for (int l : lengths) {
+    if (l < 1) throw std::invalid_argument(path + ": lengths must be positive");
+    if (n > h.count / std::uint64_t(l))
+      error(path, "lengths do not match element count");
+    n *= std::uint64_t(l);
+  }
+  if (h.rank > 0 && n != h.count)
+    error(path, "lengths do not match element count");
+
+  const int* d = reinterpret_cast<const int*>(file->data + h.data_offset);
+  return Mapped_Sequence(mapped_array(std::move(file), d, h.count), std::move(lengths));
+}
+
+#endif
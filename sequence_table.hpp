@@ -0,0 +1,302 @@
+#ifndef H_SEQUENCE_TABLE
+#define H_SEQUENCE_TABLE
+
+#include <cstdint>
+#include <stdexcept>
+#include "parallel.hpp"
+#include "sequence.hpp"
+
+// Many small ragged sequences packed together, e.g. per-record
+// feature lists.
+//
+// All records share one Ragged_Sequence, so a record costs its numbers
+// and nodes plus two offsets, and no heap objects. normalise and
+// transpose_distribute work on whole tables in parallel over records.
+// For each record the lengths and the number each output element comes
+// from are worked out from the nodes alone, and a run of records with
+// the same nodes, such as a table of same shape records, reuses them,
+// so only a gather and func are left per record.
+struct Sequence_Table {
+  Ragged_Sequence records;
+  // Start of each record in records.data and records.nodes, with one
+  // more entry for the end
+  std::vector<std::uint64_t> data_offsets {0};
+  std::vector<std::uint64_t> node_offsets {0};
+
+  std::size_t size() const { return data_offsets.size() - 1; }
+
+  void push_back(const Raw_Sequence& s) {
+    flatten_elements(records, s);
+    data_offsets.push_back(records.data.size());
+    node_offsets.push_back(records.nodes.size());
+  }
+
+  void push_back(const Ragged_Sequence& r) {
+    records.data.insert(records.data.end(), r.data.begin(), r.data.end());
+    records.nodes.insert(records.nodes.end(), r.nodes.begin(), r.nodes.end());
+    data_offsets.push_back(records.data.size());
+    node_offsets.push_back(records.nodes.size());
+  }
+
+  Ragged_Sequence record(std::size_t i) const {
+    return {
+      {records.data.begin() + data_offsets[i], records.data.begin() + data_offsets[i+1]},
+      {records.nodes.begin() + node_offsets[i], records.nodes.begin() + node_offsets[i+1]}
+    };
+  }
+};
+
+// Normalised records, each with its own lengths
+struct Normalised_Table {
+  std::vector<int> data;
+  std::vector<int> lengths;
+  // Start of each record in data and lengths, with one more entry for
+  // the end
+  std::vector<std::uint64_t> data_offsets {0};
+  std::vector<std::uint64_t> length_offsets {0};
+
+  std::size_t size() const { return data_offsets.size() - 1; }
+
+  Sequence sequence(std::size_t i) const {
+    return {
+      {data.begin() + data_offsets[i], data.begin() + data_offsets[i+1]},
+      {lengths.begin() + length_offsets[i], lengths.begin() + length_offsets[i+1]}
+    };
+  }
+};
+
+namespace table {
+  // Records handed to each parallel task
+  constexpr std::size_t chunk {4096};
+
+  // Run f(first, last) over chunks of the records [0, n)
+  template <typename F>
+  void for_chunks(std::size_t n, F&& f, unsigned threads) {
+    parallel_for((n + chunk - 1) / chunk, [&](std::size_t c) {
+      f(c * chunk, std::min(n, (c+1) * chunk));
+    }, threads);
+  }
+
+  // Raise lengths to the lengths of a record from its nodes, as
+  // get_lengths
+  inline void add_lengths(std::vector<int>& lengths, std::vector<int>& remaining,
+                          const int* nodes, std::size_t n) {
+    remaining.clear();
+    for (std::size_t k{0}; k < n; ++k) {
+      const std::size_t order = remaining.size() + 1;
+      if (!remaining.empty()) --remaining.back();
+      if (nodes[k] >= 0) {
+        if (order > lengths.size()) lengths.push_back(0);
+        lengths[order-1] = std::max(lengths[order-1], nodes[k]);
+        remaining.push_back(nodes[k]);
+      }
+      while (!remaining.empty() && remaining.back() == 0)
+        remaining.pop_back();
+    }
+  }
+
+  // For the record subtree at node, normalised to the lengths whose
+  // block sizes are blocks, write the number each element comes from
+  // to index. Returns the node after the subtree.
+  inline std::size_t map_elements(const int* nodes, std::size_t node, std::size_t order,
+      const std::vector<int>& lengths, const std::vector<std::size_t>& blocks,
+      std::uint32_t* index, std::uint32_t& leaf) {
+    const int n = nodes[node++];
+    if (n < 0) {
+      std::fill(index, index + blocks[order-1], leaf++);
+      return node;
+    }
+    if (order > lengths.size())
+      throw std::invalid_argument("normalise: lengths too small for a record");
+    const int length = lengths[order-1];
+    const std::size_t block = blocks[order];
+    if (n == 0 && length > 0)
+      throw std::out_of_range("repeat_elements: nothing to repeat");
+    for (int i{0}; i < n; ++i)
+      node = map_elements(nodes, node, order+1, lengths, blocks, index + i*block, leaf);
+    for (int i{n}; i < length; ++i)
+      std::copy(index + (i % n)*block, index + (i % n + 1)*block, index + i*block);
+    return node;
+  }
+
+  // The lengths a record of one or two tables is normalised to, and
+  // the number each element comes from. Kept from one record to the
+  // next of a chunk, and only worked out again when the nodes change.
+  // target turns the lengths of the record into the lengths wanted.
+  template <int Tables, typename F>
+  class record_map {
+    const Sequence_Table* tables[Tables];
+    F target;
+    const int* nodes[Tables] {};
+    std::size_t n_nodes[Tables] {};
+    bool mapped {false};
+    std::vector<int> remaining;
+    std::vector<std::size_t> blocks;
+  public:
+    std::vector<int> lengths;
+    std::size_t size {0};
+    std::vector<std::uint32_t> index[Tables];
+
+    record_map(const Sequence_Table* const (&t)[Tables], F f) : target(f) {
+      std::copy(t, t + Tables, tables);
+    }
+
+    // Set up for record r, with index only if with_index
+    void map(std::size_t r, bool with_index) {
+      bool same {mapped};
+      for (int t{0}; t < Tables; ++t) {
+        const auto& tab = *tables[t];
+        const int* first = tab.records.nodes.data() + tab.node_offsets[r];
+        const std::size_t n = tab.node_offsets[r+1] - tab.node_offsets[r];
+        same = same && n == n_nodes[t] && std::equal(first, first + n, nodes[t]);
+        nodes[t] = first;
+        n_nodes[t] = n;
+      }
+      if (same) return;
+
+      lengths.assign(1, 0);
+      for (int t{0}; t < Tables; ++t)
+        add_lengths(lengths, remaining, nodes[t], n_nodes[t]);
+      target(lengths);
+      blocks.assign(lengths.size() + 1, 1);
+      for (std::size_t order{lengths.size()}; order > 0; --order)
+        blocks[order-1] = blocks[order] * lengths[order-1];
+      size = blocks[0];
+      mapped = with_index;
+      if (!with_index) return;
+      for (int t{0}; t < Tables; ++t) {
+        index[t].resize(size);
+        std::uint32_t leaf{0};
+        map_elements(nodes[t], 0, 1, lengths, blocks, index[t].data(), leaf);
+      }
+    }
+  };
+
+  template <int Tables, typename F>
+  record_map(const Sequence_Table* const (&)[Tables], F) -> record_map<Tables, F>;
+
+  // Whether a record with lengths from fits in lengths to
+  inline bool fits(const std::vector<int>& from, const std::vector<int>& to) {
+    for (std::size_t i{0}; i < from.size(); ++i)
+      if (from[i] > (i < to.size() ? to[i] : 0)) return false;
+    return true;
+  }
+
+  // Normalise, or with two tables transpose_distribute, every record
+  // to its own lengths. Each chunk is worked out into its own table,
+  // and the chunks are then joined.
+  template <int Tables, typename F>
+  Normalised_Table normalise_records(const Sequence_Table* const (&tables)[Tables],
+                                     F&& compute, unsigned threads) {
+    const std::size_t n = tables[0]->size();
+    std::vector<Normalised_Table> chunks ((n + chunk - 1) / chunk);
+    for_chunks(n, [&](std::size_t first, std::size_t last) {
+      Normalised_Table& c = chunks[first / chunk];
+      record_map m (tables, [](std::vector<int>&) {});
+      for (std::size_t r{first}; r < last; ++r) {
+        m.map(r, true);
+        c.data.resize(c.data.size() + m.size);
+        compute(m, r, c.data.data() + c.data.size() - m.size);
+        c.lengths.insert(c.lengths.end(), m.lengths.begin(), m.lengths.end());
+        c.data_offsets.push_back(c.data.size());
+        c.length_offsets.push_back(c.lengths.size());
+      }
+    }, threads);
+
+    Normalised_Table result;
+    result.data_offsets.resize(n+1);
+    result.length_offsets.resize(n+1);
+    std::size_t data_size{0}, lengths_size{0};
+    for (const auto& c : chunks) {
+      data_size += c.data.size();
+      lengths_size += c.lengths.size();
+    }
+    result.data.resize(data_size);
+    result.lengths.resize(lengths_size);
+    std::vector<std::size_t> data_start (chunks.size() + 1), lengths_start (chunks.size() + 1);
+    for (std::size_t i{0}; i < chunks.size(); ++i) {
+      data_start[i+1] = data_start[i] + chunks[i].data.size();
+      lengths_start[i+1] = lengths_start[i] + chunks[i].lengths.size();
+    }
+    parallel_for(chunks.size(), [&](std::size_t i) {
+      const auto& c = chunks[i];
+      std::copy(c.data.begin(), c.data.end(), result.data.begin() + data_start[i]);
+      std::copy(c.lengths.begin(), c.lengths.end(), result.lengths.begin() + lengths_start[i]);
+      for (std::size_t r{0}; r < c.size(); ++r) {
+        result.data_offsets[i*chunk + r + 1] = data_start[i] + c.data_offsets[r+1];
+        result.length_offsets[i*chunk + r + 1] = lengths_start[i] + c.length_offsets[r+1];
+      }
+    }, threads);
+    return result;
+  }
+}
+
+// Normalise every record to its own lengths
+Normalised_Table normalise(const Sequence_Table& t, unsigned threads = 0) {
+  NTD_SPAN(span, "normalise_table");
+  NTD_SPAN_ARG(span, "records", t.size());
+  auto result = table::normalise_records<1>({&t},
+      [&](const auto& m, std::size_t r, int* out) {
+        const int* leaves = t.records.data.data() + t.data_offsets[r];
+        const std::uint32_t* index = m.index[0].data();
+        for (std::size_t i{0}; i < m.size; ++i)
+          out[i] = leaves[index[i]];
+      }, threads);
+  NTD_SPAN_ARG(span, "output", result.data.size());
+  return result;
+}
+
+// Normalise every record to lengths. The result has the records as
+// its first level.
+Sequence normalise(const Sequence_Table& t, const std::vector<int>& lengths,
+                   unsigned threads = 0) {
+  NTD_SPAN(span, "normalise_table");
+  NTD_SPAN_ARG(span, "records", t.size());
+  const std::size_t block = std::accumulate(
+      lengths.begin(), lengths.end(), std::size_t(1), std::multiplies<std::size_t>());
+  Sequence result;
+  result.lengths.push_back(t.size());
+  result.lengths.insert(result.lengths.end(), lengths.begin(), lengths.end());
+  result.data.resize(t.size() * block);
+  table::for_chunks(t.size(), [&](std::size_t first, std::size_t last) {
+    table::record_map m ({&t}, [&](std::vector<int>& l) {
+      if (!table::fits(l, lengths))
+        throw std::invalid_argument("normalise: lengths too small for a record");
+      l = lengths;
+    });
+    for (std::size_t r{first}; r < last; ++r) {
+      m.map(r, true);
+      const int* leaves = t.records.data.data() + t.data_offsets[r];
+      const std::uint32_t* index = m.index[0].data();
+      int* out = result.data.data() + r * block;
+      for (std::size_t i{0}; i < block; ++i)
+        out[i] = leaves[index[i]];
+    }
+  }, threads);
+  NTD_SPAN_ARG(span, "output", result.data.size());
+  return result;
+}
+
+// transpose_distribute of each record of a with the same record of b
+template <typename TF>
+Normalised_Table transpose_distribute(
+    const Sequence_Table& a, const Sequence_Table& b, TF&& func, unsigned threads = 0) {
+  if (a.size() != b.size())
+    throw std::invalid_argument("transpose_distribute: tables differ in size");
+  NTD_SPAN(span, "transpose_distribute_table");
+  NTD_SPAN_ARG(span, "records", a.size());
+  auto result = table::normalise_records<2>({&a, &b},
+      [&](const auto& m, std::size_t r, int* out) {
+        const int* leaves_a = a.records.data.data() + a.data_offsets[r];
+        const int* leaves_b = b.records.data.data() + b.data_offsets[r];
+        const std::uint32_t* ia = m.index[0].data();
+        const std::uint32_t* ib = m.index[1].data();
+        for (std::size_t i{0}; i < m.size; ++i)
+          out[i] = func(leaves_a[ia[i]], leaves_b[ib[i]]);
+      }, threads);
+  NTD_SPAN_ARG(span, "output", result.data.size());
+  NTD_COUNT(elements_computed, result.data.size());
+  return result;
+}
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef H_SHARED_SEQUENCE
+#define H_SHARED_SEQUENCE
+
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "sequence.hpp"
+
+// Reference counted, copy-on-write storage for Sequence data.
+//
+// Copies of a cow_vector share one buffer, so copying a Shared_Sequence
+// or passing it by value is O(1). Read access through a const
+// cow_vector never copies. Anything that may change the elements
+// (non-const data, begin, operator[], insert, ...) first takes a
+// private copy of the buffer if it is shared. The sharing is thread
+// safe as for std::shared_ptr; one cow_vector must not be changed
+// while another thread uses it.
+template <typename T>
+class cow_vector {
+  std::shared_ptr<std::vector<T>> v;
+
+  static const std::vector<T>& none() {
+    static const std::vector<T> empty;
+    return empty;
+  }
+  const std::vector<T>& get() const { return v ? *v : none(); }
+
+  // The buffer, made private to this cow_vector first
+  std::vector<T>& own() {
+    if (!v)
+      v = std::make_shared<std::vector<T>>();
+    else if (v.use_count() > 1)
+      v = std::make_shared<std::vector<T>>(std::as_const(*v));
+    return *v;
+  }
+
+public:
+  using value_type = T;
+  using size_type = std::size_t;
+  using iterator = typename std::vector<T>::iterator;
+  using const_iterator = typename std::vector<T>::const_iterator;
+
+  cow_vector() {}
+  cow_vector(std::vector<T> data) : v{std::make_shared<std::vector<T>>(std::move(data))} {}
+  cow_vector(std::initializer_list<T> l) : cow_vector(std::vector<T>(l)) {}
+  explicit cow_vector(size_type n, const T& x = T()) : cow_vector(std::vector<T>(n, x)) {}
+  template <typename It, typename = typename std::iterator_traits<It>::iterator_category>
+  cow_vector(It first, It last) : cow_vector(std::vector<T>(first, last)) {}
+
+  size_type size() const { return get().size(); }
+  bool empty() const { return get().empty(); }
+
+  const T* data() const { return get().data(); }
+  const_iterator begin() const { return get().begin(); }
+  const_iterator end() const { return get().end(); }
+  const T& operator[](size_type i) const { return get()[i]; }
+  const T& at(size_type i) const { return get().at(i); }
+
+  T* data() { return own().data(); }
+  iterator begin() { return own().begin(); }
+  iterator end() { return own().end(); }
+  T& operator[](size_type i) { return own()[i]; }
+  T& at(size_type i) { return own().at(i); }
+
+  iterator insert(const_iterator pos, size_type n, const T& x) {
+    const auto offset = pos - get().begin();
+    auto& u = own();
+    return u.insert(u.begin() + offset, n, x);
+  }
+  void push_back(const T& x) { own().push_back(x); }
+  void reserve(size_type n) { own().reserve(n); }
+  void resize(size_type n) { own().resize(n); }
+  void clear() { v.reset(); }
+
+  // The elements as a std::vector, moved out if this is the only user
+  std::vector<T> release() && {
+    std::vector<T> r;
+    if (v && v.use_count() == 1) r = std::move(*v);
+    else r = get();
+    v.reset();
+    return r;
+  }
+
+  bool shares(const cow_vector& o) const { return v && v == o.v; }
+  long use_count() const { return v.use_count(); }
+
+  friend bool operator==(const cow_vector& a, const cow_vector& b) {
+    return a.v == b.v || a.get() == b.get();
+  }
+  friend bool operator!=(const cow_vector& a, const cow_vector& b) { return !(a == b); }
+};
+
+using Shared_Sequence = Basic_Sequence<cow_vector<int>>;
+
+// Share the elements of s, without copying them
+inline Shared_Sequence share(Sequence s) {
+  return Shared_Sequence(std::move(s.data), std::move(s.lengths));
+}
+
+// Normalising to the lengths s already has gives s back in O(1),
+// still sharing its buffer. Otherwise the buffer is copied only if
+// something else shares it.
+template <typename Policy = default_policy>
+Shared_Sequence normalise(Shared_Sequence s, std::vector<int> lengths) {
+  if (s.lengths == lengths) {
+    if constexpr (Policy::validate) impl::validate_lengths(s, lengths);
+    return s;
+  }
+  Sequence t = normalise<Policy>(Sequence(std::move(s.data).release(), std::move(s.lengths)),
+                                 std::move(lengths));
+  return share(std::move(t));
+}
+
+#endif
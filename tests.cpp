@@ -2,7 +2,21 @@
 #define DOCTEST_CONFIG_IMPLEMENT
 
 #include "doctest.h"
+#include <sstream>
+#include <filesystem>
+#include <thread>
 #include "sequence.hpp"
+#include "parse.hpp"
+#include "sequence_file.hpp"
+#include "archive.hpp"
+#include "generator.hpp"
+#include "capture.hpp"
+#include "fixed_sequence.hpp"
+#include "huge_pages.hpp"
+#include "out_of_core.hpp"
+#include "raw_index.hpp"
+#include "shared_sequence.hpp"
+#include "persistent_sequence.hpp"
 
 TEST_CASE("repeating elements") {
   std::vector<int> a;
@@ -344,6 +358,60 @@ TEST_CASE("normalise Sequence") {
   }
 }
 
+TEST_CASE("shared sequences") {
+  Shared_Sequence a = share(Sequence({2,2,3,3,7,8,4,4}, {4,2}));
+
+  SUBCASE("copies share the elements") {
+    Shared_Sequence b = a;
+    CHECK(b.data.shares(a.data));
+    CHECK(a.data.use_count() == 2);
+    CHECK(std::as_const(b).data[2] == 3);
+    CHECK(b.data.shares(a.data));
+  }
+
+  SUBCASE("changing a copy clones it") {
+    Shared_Sequence b = a;
+    b.data[0] = 9;
+    CHECK_FALSE(b.data.shares(a.data));
+    CHECK(a.data == cow_vector<int>{2,2,3,3,7,8,4,4});
+    CHECK(b.data == cow_vector<int>{9,2,3,3,7,8,4,4});
+    CHECK(a.data.use_count() == 1);
+  }
+
+  SUBCASE("normalise to the same lengths") {
+    auto normalised = normalise(a, std::vector<int>{4,2});
+    CHECK(normalised.data.shares(a.data));
+    CHECK(normalised.lengths == a.lengths);
+  }
+
+  SUBCASE("normalise") {
+    Shared_Sequence b = a;
+    auto normalised = normalise(b, std::vector<int>{5,3});
+    CHECK_FALSE(normalised.data.shares(a.data));
+    CHECK(normalised.data == cow_vector<int>{2,2,2,3,3,3,7,8,7,4,4,4,2,2,2});
+    CHECK(normalised.lengths == std::vector<int>{5,3});
+    CHECK(a.data == cow_vector<int>{2,2,3,3,7,8,4,4});
+  }
+
+  SUBCASE("release") {
+    // The only user of the elements gives them up without a copy
+    const int* data = std::as_const(a).data.data();
+    Shared_Sequence b = a;
+    auto copied = std::move(b.data).release();
+    CHECK(copied.data() != data);
+    auto moved = std::move(a.data).release();
+    CHECK(moved.data() == data);
+    CHECK(moved == copied);
+  }
+
+  SUBCASE("transpose_distribute") {
+    Sequence b {{1,2}, {2}};
+    auto result = transpose_distribute(a, b, std::plus<int>());
+    CHECK(result.data == std::vector<int>{3,4,4,5,8,10,5,6});
+    CHECK(result.lengths == std::vector<int>{4,2});
+  }
+}
+
 TEST_CASE("testing transpose-distribute") {
   Raw_Sequence a,b;
 
@@ -403,3 +471,1000 @@ TEST_CASE("testing transpose-distribute") {
     CHECK(result.data == std::vector{ 20,30,20,40,60,70 });
   }
 }
+
+TEST_CASE("small inputs") {
+  // Same as normalising both operands and transforming
+  auto expected = [](const Raw_Sequence& a, const Raw_Sequence& b) {
+    auto lengths = get_lengths({a,b});
+    auto x = normalise(a, lengths), y = normalise(b, lengths);
+    std::transform(x.data.begin(), x.data.end(), y.data.begin(), x.data.begin(),
+                   std::minus<int>());
+    return x;
+  };
+
+  generator_options opt;
+  opt.leaves = 10;
+  opt.max_fan_out = 4;
+  for (std::uint64_t seed{0}; seed < 100; ++seed) {
+    opt.seed = 2*seed;
+    Raw_Sequence a = generate(opt);
+    opt.seed = 2*seed + 1;
+    Raw_Sequence b = generate(opt);
+    auto result = transpose_distribute(a, b, std::minus<int>());
+    auto e = expected(a, b);
+    CHECK(result.data == e.data);
+    CHECK(result.lengths == e.lengths);
+  }
+
+  CHECK_THROWS_AS(transpose_distribute(vec{vec{}, 1}, vec{vec{1,2}}, std::plus<int>()),
+                  std::out_of_range);
+
+#ifdef NTD_COUNTERS
+  counters::reset();
+  transpose_distribute(vec{1,vec{2,3}}, vec{vec{4},5,6}, std::plus<int>());
+  // The data and lengths of the result
+  CHECK(counters::snapshot().allocations == 2);
+  CHECK(counters::snapshot().elements_computed == 6);
+#endif
+}
+
+TEST_CASE("same shape inputs") {
+  // 20 x 30, too big for the small input path
+  vec rows, other_rows;
+  for (int i{0}; i < 20; ++i) {
+    vec row, other_row;
+    for (int j{0}; j < 30; ++j) {
+      row.emplace_back(i * 30 + j);
+      other_row.emplace_back(j - i);
+    }
+    rows.emplace_back(row);
+    other_rows.emplace_back(other_row);
+  }
+  Raw_Sequence a = rows, b = other_rows;
+  auto lengths = get_lengths({a,b});
+  auto e = normalise(a, lengths).data;
+  auto f = normalise(b, lengths).data;
+  std::transform(e.begin(), e.end(), f.begin(), e.begin(), std::minus<int>());
+
+  int calls {0};
+  auto minus = [&](int x, int y) { ++calls; return x - y; };
+#ifdef NTD_COUNTERS
+  counters::reset();
+#endif
+  auto result = transpose_distribute(a, b, minus);
+  CHECK(result.data == e);
+  CHECK(result.lengths == std::vector<int>{20,30});
+  CHECK(calls == 600);
+#ifdef NTD_COUNTERS
+  CHECK(counters::snapshot().allocations == 2);
+#endif
+
+  // Same first lengths, but ragged further on: the general path, with
+  // func called once per element
+  std::get<vec>(std::get<vec>(b)[19].data).pop_back();
+  calls = 0;
+  result = transpose_distribute(a, b, minus);
+  CHECK(calls == 600);
+  CHECK(result.data[599] == 599 + 19);
+}
+
+TEST_CASE("sequence tables") {
+  generator_options opt;
+  opt.leaves = 3000;
+  opt.max_fan_out = 3;
+  auto x = generate_table(opt, 2);
+  opt.seed = 1;
+  auto y = generate_table(opt, 2);
+  const std::size_t n = std::min(x.size(), y.size());
+  REQUIRE(n > 100);
+  Sequence_Table a, b;
+  for (std::size_t r{0}; r < n; ++r) {
+    a.push_back(x.record(r));
+    b.push_back(y.record(r));
+  }
+
+  SUBCASE("records") {
+    CHECK(to_raw(a.record(0)).index() == 1);
+    Sequence_Table t;
+    t.push_back(vec{1,vec{2,3}});
+    t.push_back(7);
+    CHECK(t.size() == 2);
+    CHECK(t.record(1).data == std::vector<int>{7});
+    CHECK(t.record(0).nodes == std::vector<int>{2,-1,2,-1,-1});
+  }
+
+  SUBCASE("same as each record") {
+    auto result = transpose_distribute(a, b, std::minus<int>(), 3);
+    REQUIRE(result.size() == n);
+    bool same {true};
+    for (std::size_t r{0}; r < n; ++r) {
+      auto e = transpose_distribute(to_raw(a.record(r)), to_raw(b.record(r)), std::minus<int>());
+      auto x = result.sequence(r);
+      same = same && x.data == e.data && x.lengths == e.lengths;
+    }
+    CHECK(same);
+
+    auto own = normalise(b, 2);
+    bool same_own {true};
+    for (std::size_t r{0}; r < n; ++r) {
+      Raw_Sequence s = to_raw(b.record(r));
+      auto e = normalise(s, get_lengths(s));
+      same_own = same_own && own.sequence(r).data == e.data;
+    }
+    CHECK(same_own);
+  }
+
+  SUBCASE("common lengths") {
+    Sequence_Table t;
+    t.push_back(vec{1,vec{2,3}});
+    t.push_back(vec{vec{4},5,6});
+    auto result = normalise(t, {3,2});
+    CHECK(result.lengths == std::vector<int>{2,3,2});
+    CHECK(result.data == std::vector<int>{1,1,2,3,1,1, 4,4,5,5,6,6});
+    CHECK_THROWS_AS(normalise(t, {2,2}), std::invalid_argument);
+    t.push_back(vec{1,vec{}});
+    CHECK_THROWS_AS(normalise(t, {3,2}), std::out_of_range);
+  }
+}
+
+TEST_CASE("execution policies") {
+  Raw_Sequence a = vec{vec{1,2,3}, 4, vec{5,vec{6,7}}};
+  Raw_Sequence b = vec{10, vec{20,30}};
+
+  SUBCASE("same results") {
+    auto lengths = get_lengths<unchecked>({a,b});
+    CHECK(lengths == get_lengths<checked>({a,b}));
+    auto x = normalise<checked>(a, lengths);
+    auto y = normalise<unchecked>(a, lengths);
+    CHECK(x.data == y.data);
+    CHECK(x.lengths == y.lengths);
+    Sequence s ({1,2,3,4}, {2,2});
+    CHECK(normalise<unchecked>(s, {3,2,4}).data == normalise<checked>(s, {3,2,4}).data);
+    auto p = transpose_distribute<checked>(a, b, std::plus<int>());
+    auto q = transpose_distribute<unchecked>(a, b, std::plus<int>());
+    CHECK(p.data == q.data);
+    CHECK(p.lengths == q.lengths);
+  }
+
+  SUBCASE("checked throws on bad lengths") {
+    CHECK_THROWS_AS(normalise<checked>(a, {2,2}), std::out_of_range);
+    CHECK_THROWS_AS(normalise<checked>(vec{}, {2}), std::out_of_range);
+  }
+
+  SUBCASE("unchecked validates once") {
+    CHECK_THROWS_AS(normalise<unchecked>(a, {3,3}), std::invalid_argument);
+    CHECK_THROWS_AS(normalise<unchecked>(a, {2,3,2}), std::invalid_argument);
+    CHECK_THROWS_AS(normalise<unchecked>(a, {3,0,2}), std::invalid_argument);
+    CHECK_THROWS_AS(normalise<unchecked>(Sequence({1,2,3}, {2,2}), {2,2}), std::invalid_argument);
+  }
+
+  SUBCASE("Sequence data sizes are checked under every policy") {
+    Sequence x ({1,2,3,4,5,6}, {2,3});
+    Sequence y ({1,2}, {2,3});
+    auto plus = std::plus<int>();
+    CHECK_THROWS_AS(transpose_distribute<checked>(x, y, plus), std::invalid_argument);
+    CHECK_THROWS_AS(transpose_distribute<unchecked>(x, y, plus), std::invalid_argument);
+    CHECK_THROWS_AS(transpose_distribute<checked>(y, x, plus), std::invalid_argument);
+  }
+
+  SUBCASE("unchecked transpose_distribute with nothing to repeat") {
+    auto plus = std::plus<int>();
+    CHECK_THROWS_AS(transpose_distribute<unchecked>(Raw_Sequence(5), Raw_Sequence(6), plus),
+                    std::invalid_argument);
+    CHECK_THROWS_AS(transpose_distribute<unchecked>(vec{vec{}, 1}, vec{7,8}, plus),
+                    std::invalid_argument);
+    CHECK_THROWS_AS(transpose_distribute<checked>(Raw_Sequence(5), Raw_Sequence(6), plus),
+                    std::out_of_range);
+    CHECK_THROWS_AS(transpose_distribute<checked>(vec{vec{}, 1}, vec{7,8}, plus),
+                    std::out_of_range);
+  }
+}
+
+TEST_CASE("allocators") {
+  Raw_Sequence a = vec{vec{1,2,3}, 4, vec{5,vec{6,7}}};
+  Raw_Sequence b = vec{10, vec{20,30}};
+  std::array<std::byte, 4096> buffer;
+  std::pmr::monotonic_buffer_resource arena {buffer.data(), buffer.size(),
+                                             std::pmr::null_memory_resource()};
+  std::pmr::polymorphic_allocator<int> alloc {&arena};
+
+  SUBCASE("normalise") {
+    auto lengths = get_lengths(a);
+    Pmr_Sequence x = normalise(a, lengths, alloc);
+    auto e = normalise(a, lengths);
+    CHECK(std::equal(x.data.begin(), x.data.end(), e.data.begin(), e.data.end()));
+    CHECK(std::equal(x.lengths.begin(), x.lengths.end(), e.lengths.begin(), e.lengths.end()));
+    CHECK(x.data.get_allocator().resource() == &arena);
+    CHECK(x.lengths.get_allocator().resource() == &arena);
+    CHECK_THROWS_AS(normalise(a, {2,2}, alloc), std::invalid_argument);
+
+    Sequence s ({1,2,3,4}, {2,2});
+    auto y = normalise(s, {3,2,4}, alloc);
+    auto f = normalise(s, {3,2,4});
+    CHECK(std::equal(y.data.begin(), y.data.end(), f.data.begin(), f.data.end()));
+  }
+
+  SUBCASE("transpose_distribute") {
+    auto x = transpose_distribute(a, b, std::plus<int>(), alloc);
+    auto e = transpose_distribute(a, b, std::plus<int>());
+    CHECK(std::equal(x.data.begin(), x.data.end(), e.data.begin(), e.data.end()));
+    CHECK(std::equal(x.lengths.begin(), x.lengths.end(), e.lengths.begin(), e.lengths.end()));
+
+    Sequence s ({1,2,3,4}, {2,2});
+    Pmr_Sequence t = normalise(s, {2,2}, alloc);
+    auto y = transpose_distribute(s, t, std::multiplies<int>(), alloc);
+    CHECK(y.data == std::pmr::vector<int>{1,4,9,16});
+    auto z = transpose_distribute(t, Sequence({1,2}, {1,2}), std::plus<int>());
+    CHECK(z.data == std::vector<int>{2,4,4,6});
+
+    Sequence short_data ({1,2}, {2,2});
+    CHECK_THROWS_AS(transpose_distribute<checked>(s, short_data, std::plus<int>(), alloc),
+                    std::invalid_argument);
+  }
+
+  SUBCASE("std::allocator") {
+    Sequence x = transpose_distribute(a, b, std::plus<int>(), std::allocator<int>());
+    CHECK(x.data == transpose_distribute(a, b, std::plus<int>()).data);
+  }
+}
+
+TEST_CASE("huge pages") {
+  // 2^20 numbers, 4 MiB
+  const int n = 1 << 20;
+  Sequence a (std::vector<int>(n), {n});
+  std::iota(a.data.begin(), a.data.end(), 0);
+  Sequence b ({1,2,3,4}, {1,4});
+
+  SUBCASE("allocator") {
+    huge_page_allocator<int> alloc;
+    int* p = alloc.allocate(n);
+    CHECK(reinterpret_cast<std::uintptr_t>(p) % huge_pages::page_size == 0);
+    p[0] = p[n-1] = 1;
+    alloc.deallocate(p, n);
+    std::vector<int, huge_page_allocator<int>> small (10, 7);
+    CHECK(small[9] == 7);
+  }
+
+  SUBCASE("same results") {
+    for (auto mode : {huge_pages::transparent, huge_pages::explicit_pages}) {
+      huge_page_allocator<int> alloc {mode};
+      auto x = transpose_distribute(a, Sequence({n-1}, {1}), std::plus<int>(), alloc, 3);
+      REQUIRE(x.data.size() == n);
+      CHECK(x.data[0] == n-1);
+      CHECK(x.data[n-1] == 2*n-2);
+      Sequence c ({1,2}, {2,1});
+      auto y = transpose_distribute(c, b, std::multiplies<int>(), alloc, 2);
+      CHECK(std::vector<int>(y.data.begin(), y.data.end()) == std::vector{1,2,3,4, 2,4,6,8});
+      CHECK(std::vector<int>(y.lengths.begin(), y.lengths.end()) == std::vector{2,4});
+      Raw_Sequence r = vec{vec{1,2,3}, 4, vec{5,vec{6,7}}};
+      Raw_Sequence s = vec{10, vec{20,30}};
+      auto z = transpose_distribute(r, s, std::plus<int>(), alloc, 2);
+      auto e = transpose_distribute(r, s, std::plus<int>());
+      CHECK(std::equal(z.data.begin(), z.data.end(), e.data.begin(), e.data.end()));
+      CHECK_THROWS_AS(transpose_distribute<checked>(Sequence({1,2,3,4,5,6}, {2,3}),
+                                                    Sequence({1,2}, {2,3}),
+                                                    std::plus<int>(), alloc, 2),
+                      std::invalid_argument);
+    }
+  }
+}
+
+TEST_CASE("fixed sequences") {
+  Fixed_Sequence<int,3,4> a {{1,2,3,4, 5,6,7,8, 9,10,11,12}};
+  Fixed_Sequence<int,1,4> b {{1,10,100,1000}};
+  Fixed_Sequence<int,4> c {{1,2,3,4}};
+
+  SUBCASE("same as Sequence") {
+    auto x = transpose_distribute(a, b, std::plus<int>());
+    static_assert(std::is_same_v<decltype(x), Fixed_Sequence<int,3,4>>);
+    auto y = transpose_distribute(a.sequence(), b.sequence(), std::plus<int>());
+    CHECK(std::vector<int>(x.data.begin(), x.data.end()) == y.data);
+
+    auto z = transpose_distribute(a, c, std::multiplies<int>());
+    static_assert(std::is_same_v<decltype(z), Fixed_Sequence<int,4,4>>);
+    auto w = transpose_distribute(a.sequence(), c.sequence(), std::multiplies<int>());
+    CHECK(std::vector<int>(z.data.begin(), z.data.end()) == w.data);
+    CHECK(w.lengths == std::vector<int>{4,4});
+
+    Fixed_Sequence<int,20,20> big {};
+    for (int i{0}; i < 400; ++i) big.data[i] = i;
+    auto u = transpose_distribute(big, Fixed_Sequence<int,20>{{}}, std::minus<int>());
+    CHECK(std::vector<int>(u.data.begin(), u.data.end()) == big.sequence().data);
+
+    auto n = normalise<2,3,4>(b);
+    CHECK(std::vector<int>(n.data.begin(), n.data.end())
+          == normalise(b.sequence(), {2,3,4}).data);
+  }
+
+  SUBCASE("mixed with Sequence") {
+    Sequence s ({1,10,100,1000}, {1,4});
+    auto x = transpose_distribute(a, s, std::plus<int>());
+    CHECK(x.lengths == std::vector<int>{3,4});
+    CHECK(x.data == transpose_distribute(a, b, std::plus<int>()).sequence().data);
+    CHECK(transpose_distribute(s, a, std::plus<int>()).data == x.data);
+    CHECK(to_fixed<int,3,4>(x).data[11] == 1012);
+    CHECK_THROWS_AS((to_fixed<int,4,3>(x)), std::invalid_argument);
+  }
+
+  SUBCASE("compile time") {
+    constexpr Fixed_Sequence<int,2,2> p {{1,2,3,4}};
+    constexpr Fixed_Sequence<int,2> q {{10,20}};
+    constexpr auto r = transpose_distribute(p, q, std::plus<int>());
+    static_assert(r.data[0] == 11 && r.data[1] == 22 && r.data[2] == 13 && r.data[3] == 24);
+  }
+}
+
+#if __cpp_constexpr_dynamic_alloc >= 201907L && __cpp_consteval >= 201811L
+TEST_CASE("constant evaluation") {
+  constexpr auto t = static_sequence([] {
+    return transpose_distribute(vec{1,2,3}, vec{vec{1,2},3}, std::plus<int>());
+  });
+  static_assert(t.lengths[0] == 3 && t.lengths[1] == 2);
+  static_assert(t.data[0] == 2 && t.data[3] == 5 && t.data[5] == 5);
+  CHECK(t.sequence().data == transpose_distribute(
+        vec{1,2,3}, vec{vec{1,2},3}, std::plus<int>()).data);
+
+  constexpr auto u = static_sequence([] {
+    return normalise<unchecked>(Sequence({1,2}, {2}), {3,2});
+  });
+  static_assert(u.data.size() == 6 && u.data[4] == 1);
+
+  constexpr auto l = static_sequence([] {
+    return Sequence(get_lengths({vec{1,2,3}, vec{vec{1,2}}}), {});
+  });
+  static_assert(l.data.size() == 2 && l.data[0] == 3 && l.data[1] == 2);
+}
+#endif
+
+TEST_CASE("flattening") {
+  Raw_Sequence a;
+
+  SUBCASE("number") {
+    a = 5;
+    auto r = flatten(a);
+    CHECK(r.data == std::vector<int>{5});
+    CHECK(r.nodes == std::vector<int>{-1});
+    CHECK(std::get<int>(to_raw(r)) == 5);
+  }
+
+  SUBCASE("order 2") {
+    a = vec{2,vec{7,8},vec{}};
+    auto r = flatten(a);
+    CHECK(r.data == std::vector<int>{2,7,8});
+    CHECK(r.nodes == std::vector<int>{3,-1,2,-1,-1,0});
+    CHECK(get_lengths(to_raw(r)) == std::vector<int>{3,2});
+    CHECK(flatten(to_raw(r)).nodes == r.nodes);
+  }
+}
+
+TEST_CASE("parsing") {
+  SUBCASE("ragged") {
+    auto r = parse_ragged("[[2,7,8],[4,8]]");
+    CHECK(r.data == std::vector<int>{2,7,8,4,8});
+    CHECK(r.nodes == std::vector<int>{2,3,-1,-1,-1,2,-1,-1});
+  }
+
+  SUBCASE("raw") {
+    auto a = parse(" [ 2 , 3, [-4,5], [] ]\n");
+    auto r = flatten(a);
+    CHECK(r.data == std::vector<int>{2,3,-4,5});
+    CHECK(r.nodes == std::vector<int>{4,-1,-1,2,-1,-1,0});
+  }
+
+  SUBCASE("number") {
+    CHECK(std::get<int>(parse("73")) == 73);
+    CHECK(std::get<int>(parse("-2147483648")) == -2147483648);
+  }
+
+  SUBCASE("long numbers") {
+    auto r = parse_ragged("[123456789,2147483647,98765432,1234567,0]");
+    CHECK(r.data == std::vector<int>{123456789,2147483647,98765432,1234567,0});
+  }
+
+  SUBCASE("same result as literals") {
+    Raw_Sequence a = vec{ vec{5}, vec{3,6,9}, vec{2,2} };
+    auto b = parse("[[5],[3,6,9],[2,2]]");
+    CHECK(get_lengths(b) == get_lengths(a));
+    CHECK(normalise(b, {3,3}).data == normalise(a, {3,3}).data);
+  }
+
+  SUBCASE("errors") {
+    CHECK_THROWS_AS(parse("[1,2"), std::invalid_argument);
+    CHECK_THROWS_AS(parse("[1,,2]"), std::invalid_argument);
+    CHECK_THROWS_AS(parse("[1,2]]"), std::invalid_argument);
+    CHECK_THROWS_AS(parse("[1 2]"), std::invalid_argument);
+    CHECK_THROWS_AS(parse("[2147483648]"), std::invalid_argument);
+    CHECK_THROWS_AS(parse(""), std::invalid_argument);
+  }
+}
+
+TEST_CASE("printing") {
+  std::ostringstream os;
+
+  SUBCASE("Raw_Sequence") {
+    Raw_Sequence a = vec{2,3,vec{-4,5},vec{}};
+    os << a;
+    CHECK(os.str() == "[2, 3, [-4, 5], []]");
+  }
+
+  SUBCASE("Sequence") {
+    Sequence a {{1,2,3,4,5,6}, {2,3}};
+    os << a;
+    CHECK(os.str() == "[[1, 2, 3], [4, 5, 6]]");
+  }
+
+  SUBCASE("normalised Raw_Sequence") {
+    Raw_Sequence a = vec{2,3,vec{7,8},4};
+    os << normalise(a, get_lengths(a));
+    CHECK(os.str() == "[[2, 2], [3, 3], [7, 8], [4, 4]]");
+  }
+
+  SUBCASE("summarised") {
+    print_options opt;
+    opt.summarise = true;
+    opt.threshold = 10;
+    opt.edge_items = 1;
+    std::vector<int> data (60);
+    std::iota(data.begin(), data.end(), 0);
+    print(os, Sequence{data, {3,20}}, opt);
+    CHECK(os.str() == "[[0, ..., 19], ..., [40, ..., 59]]");
+  }
+
+  SUBCASE("not summarised below threshold") {
+    print_options opt;
+    opt.summarise = true;
+    opt.edge_items = 1;
+    Raw_Sequence a = vec{1,2,3,4};
+    print(os, a, opt);
+    CHECK(os.str() == "[1, 2, 3, 4]");
+    os.str("");
+    opt.threshold = 3;
+    print(os, a, opt);
+    CHECK(os.str() == "[1, ..., 4]");
+  }
+}
+
+TEST_CASE("sequence files") {
+  const auto path = (std::filesystem::temp_directory_path() / "ntd_test.seq").string();
+
+  SUBCASE("round trip") {
+    Sequence a {{1,2,3,4,5,6}, {2,3}};
+    save(a, path);
+    auto b = load(path);
+    CHECK(b.lengths == a.lengths);
+    CHECK(std::vector<int>(b.data.begin(), b.data.end()) == a.data);
+    CHECK(reinterpret_cast<std::uintptr_t>(b.data.data()) % 64 == 0);
+  }
+
+  SUBCASE("transpose-distribute over mapped data") {
+    save(Sequence{{1,2,3,4}, {2,2}}, path);
+    auto a = load(path);
+    Sequence b {{10,20}, {2}};
+    auto result = transpose_distribute(a, b, std::plus<int>());
+    CHECK(result.data == std::vector{ 11,22,13,24 });
+    CHECK(result.lengths == std::vector<int>{2,2});
+    CHECK(transpose_distribute(a, a, std::multiplies<int>()).data == std::vector{ 1,4,9,16 });
+  }
+
+  SUBCASE("bad files") {
+    std::ofstream(path) << "[1,2,3]";
+    CHECK_THROWS_AS(load(path), std::runtime_error);
+    CHECK_THROWS(load(path + ".missing"));
+  }
+
+  SUBCASE("bad lengths") {
+    // Written as is, without the checks normalise would make
+    save(Sequence{{1,2,3,4}, {-2,-2}}, path);
+    CHECK_THROWS_AS(load(path), std::invalid_argument);
+    save(Sequence{{1,2,3,4}, {0,4}}, path);
+    CHECK_THROWS_AS(load(path), std::invalid_argument);
+    // 2^64 elements, which wraps to the element count of 0
+    save(Sequence{{}, {65536,65536,65536,65536}}, path);
+    CHECK_THROWS_AS(load(path), std::runtime_error);
+  }
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("archives") {
+  const auto path = (std::filesystem::temp_directory_path() / "ntd_test.ntda").string();
+  Raw_Sequence a;
+
+  SUBCASE("round trip") {
+    a = vec{ vec{2,7,8}, vec{4,8}, 6, vec{}, vec{vec{-5,2147483647},-2147483647-1} };
+    for (std::size_t block_leaves : {1, 3, 1 << 16}) {
+      save_archive(a, path, block_leaves);
+      auto b = load_archive(path);
+      CHECK(flatten(b).data == flatten(a).data);
+      CHECK(flatten(b).nodes == flatten(a).nodes);
+    }
+  }
+
+  SUBCASE("number and empty vector") {
+    a = 73;
+    save_archive(a, path);
+    CHECK(std::get<int>(load_archive(path)) == 73);
+    a = vec{};
+    save_archive(a, path);
+    CHECK(std::get<vec>(load_archive(path)).empty());
+  }
+
+  SUBCASE("feeds normalise") {
+    a = vec{ vec{5}, vec{3,6,9}, vec{2,2} };
+    save_archive(a, path, 2);
+    auto b = load_archive(path);
+    CHECK(normalise(b, get_lengths(b)).data == std::vector{ 5,5,5, 3,6,9, 2,2,2 });
+  }
+
+  SUBCASE("bad files") {
+    std::ofstream(path) << "[1,2,3]";
+    CHECK_THROWS_AS(load_archive(path), std::runtime_error);
+  }
+
+  SUBCASE("counts too large for the block") {
+    auto decode = [](const std::string& block) {
+      auto p = reinterpret_cast<const unsigned char*>(block.data());
+      return archive::decode_block({p, p + block.size()});
+    };
+    // 2^40 records
+    std::string block;
+    archive::put_varint(block, std::uint64_t(1) << 40);
+    archive::put_varint(block, 1);
+    CHECK_THROWS_AS(decode(block), std::runtime_error);
+
+    // One record, a vector of 2^32 - 2 elements
+    block.clear();
+    archive::put_varint(block, 1);
+    archive::put_varint(block, 2);
+    archive::put_varint(block, 1);
+    block.push_back(char(32));
+    archive::put_packed(block, {0xffffffff}, 32);
+    CHECK_THROWS_AS(decode(block), std::runtime_error);
+  }
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("raw index") {
+  Raw_Sequence a = vec{vec{1,2,3}, 4, vec{5,vec{6,7}}};
+  Raw_Index index (a);
+  CHECK(index.lengths() == get_lengths(a));
+  CHECK(index({0,1,0}) == 2);
+  CHECK(index({1,2,1}) == 4);
+  CHECK(index({2,1,1}) == 7);
+  CHECK(index({2,2,0}) == 5);
+  CHECK(index({5,3,3}) == index({2,1,1}));
+  CHECK_THROWS_AS(index({2,1}), std::invalid_argument);
+  CHECK_THROWS_AS(Raw_Index(vec{1,vec{}})({1,0}), std::out_of_range);
+  CHECK_THROWS_AS(index({-1,0}), std::out_of_range);
+  CHECK_THROWS_AS(index({0,-3}), std::out_of_range);
+  CHECK_THROWS_AS(Raw_Index(5)({-1}), std::out_of_range);
+  CHECK(Raw_Index(7)({}) == 7);
+
+  generator_options opt;
+  opt.leaves = 300;
+  opt.max_fan_out = 5;
+  bool same {true};
+  for (std::uint64_t seed{0}; seed < 10; ++seed) {
+    opt.seed = seed;
+    Raw_Sequence s = generate(opt);
+    auto lengths = get_lengths(s);
+    for (auto& l : lengths) ++l;
+    auto e = normalise(s, lengths);
+    Raw_Index t (s);
+    std::vector<int> i (lengths.size());
+    for (int x : e.data) {
+      same = same && t.at(i) == x;
+      for (std::size_t order{i.size()}; order-- > 0 && ++i[order] == lengths[order];)
+        i[order] = 0;
+    }
+  }
+  CHECK(same);
+}
+
+TEST_CASE("persistent sequences") {
+  Raw_Sequence raw = vec{ vec{1,2}, vec{3}, vec{ vec{4,5,6}, 7 } };
+  Persistent_Sequence a (raw);
+  auto same = [](const Raw_Sequence& x, const Raw_Sequence& y) {
+    auto fx = flatten(x), fy = flatten(y);
+    return fx.nodes == fy.nodes && fx.data == fy.data;
+  };
+  CHECK(get_lengths(a) == get_lengths(raw));
+  CHECK(same(a.raw(), raw));
+  CHECK(same(a.at({2,0}).raw(), Raw_Sequence(vec{4,5,6})));
+  CHECK(a.at({2,1}).value() == 7);
+  CHECK(get_lengths(Persistent_Sequence(5)) == get_lengths(Raw_Sequence(5)));
+
+  SUBCASE("set") {
+    auto b = a.set({0,1}, 9);
+    CHECK(same(b.raw(), Raw_Sequence(vec{ vec{1,9}, vec{3}, vec{ vec{4,5,6}, 7 } })));
+    CHECK(same(a.raw(), raw));
+    CHECK(b[1].shares(a[1]));
+    CHECK(b[2].shares(a[2]));
+    CHECK_FALSE(b[0].shares(a[0]));
+
+    // Lengths grow and shrink with the edit
+    auto c = b.set({1}, vec{ vec{1,2,3,4,5} });
+    CHECK(get_lengths(c) == std::vector<int>{3,2,5});
+    CHECK(get_lengths(c) == get_lengths(c.raw()));
+    auto d = c.set({1}, 3).set({2,0}, 4);
+    CHECK(get_lengths(d) == std::vector<int>{3,2});
+    CHECK(get_lengths(d) == get_lengths(d.raw()));
+  }
+
+  SUBCASE("push_back") {
+    auto b = a.push_back({}, vec{8});
+    auto c = b.push_back({2,0}, 10);
+    CHECK(same(c.raw(), Raw_Sequence(vec{ vec{1,2}, vec{3}, vec{ vec{4,5,6,10}, 7 }, vec{8} })));
+    CHECK(get_lengths(c) == std::vector<int>{4,2,4});
+    CHECK(get_lengths(a) == std::vector<int>{3,2,3});
+    CHECK(c[0].shares(a[0]));
+    CHECK(c[3].shares(b[3]));
+    CHECK(c == Persistent_Sequence(c.raw()));
+    CHECK(c != b);
+  }
+
+  SUBCASE("wide vectors") {
+    // Past 32 and 1024 children the tree of chunks grows a level
+    vec v;
+    for (int i{0}; i < 1000; ++i) v.push_back(i);
+    Persistent_Sequence b (Raw_Sequence{v});
+    for (int i{1000}; i < 1100; ++i) {
+      b = b.push_back({}, i);
+      v.push_back(i);
+    }
+    b = b.set({1050}, vec{1,2,3}).set({5}, -5);
+    v[1050] = vec{1,2,3};
+    v[5] = -5;
+    CHECK(b.size() == 1100);
+    CHECK(same(b.raw(), v));
+    CHECK(get_lengths(b) == std::vector<int>{1100,3});
+    CHECK(b[1099].value() == 1099);
+    CHECK(b.at({1050,2}).value() == 3);
+    CHECK(b == Persistent_Sequence(Raw_Sequence{v}));
+    auto c = b.set({1050}, 7);
+    CHECK(get_lengths(c) == std::vector<int>{1100});
+    CHECK(c[0].shares(b[0]));
+  }
+
+  SUBCASE("errors") {
+    CHECK_THROWS_AS(a.at({3}), std::out_of_range);
+    CHECK_THROWS_AS(a.set({0,0,0}, 1), std::out_of_range);
+    CHECK_THROWS_AS(a.push_back({0,0}, 1), std::invalid_argument);
+    CHECK_THROWS_AS(a.value(), std::invalid_argument);
+  }
+
+  SUBCASE("normalise and transpose_distribute") {
+    auto lengths = get_lengths(a);
+    CHECK(normalise(a, lengths).data == normalise(raw, lengths).data);
+    Persistent_Sequence b (Raw_Sequence(10));
+    auto result = transpose_distribute(a, b, std::plus<int>());
+    auto expected = transpose_distribute(raw, Raw_Sequence(10), std::plus<int>());
+    CHECK(result.data == expected.data);
+    CHECK(result.lengths == expected.lengths);
+  }
+}
+
+TEST_CASE("compute on unique pairs") {
+  int calls {0};
+  auto add = [&](int x, int y) { ++calls; return x + y; };
+
+  Raw_Sequence a = vec{vec{1,2,3}, 4, vec{5,vec{6,7}}};
+  Raw_Sequence b = vec{10, vec{20,30}};
+  auto result = transpose_distribute_unique(a, b, add);
+  auto e = transpose_distribute(a, b, std::plus<int>());
+  CHECK(result.data == e.data);
+  CHECK(result.lengths == e.lengths);
+
+  // 30 fills its block of two with one call
+  calls = 0;
+  result = transpose_distribute_unique(vec{1}, vec{vec{vec{10,20}}, 30}, add);
+  CHECK(result.data == std::vector<int>{11,21,31,31});
+  CHECK(calls == 3);
+
+  calls = 0;
+  Raw_Sequence row = vec{vec{1,2,3,4}};
+  Raw_Sequence column = vec{1,2,3,4,5,6,7,8};
+  result = transpose_distribute_unique(row, column, add);
+  CHECK(result.data.size() == 32);
+  CHECK(calls == 32);
+  calls = 0;
+  result = transpose_distribute_unique(vec{1,2}, vec{vec{1,2,3,4,5,6,7,8}}, add);
+  CHECK(result.lengths == std::vector<int>{2,8});
+  CHECK(calls == 16);
+  // Cycling {1,2} and {10,20,30,40} to 8 repeats after 4
+  calls = 0;
+  Raw_Sequence c = vec{vec{1,2}, vec{1,2,3,4,5,6,7,8}};
+  Raw_Sequence d = vec{vec{10,20,30,40}, 0};
+  result = transpose_distribute_unique(c, d, add);
+  CHECK(calls == 12);
+  CHECK(result.data == transpose_distribute(c, d, std::plus<int>()).data);
+  calls = 0;
+  result = transpose_distribute_unique(vec{1,2}, vec{vec{1,2}, vec{1,2}, vec{1,2}, vec{1,2}}, add);
+  CHECK(calls == 8);
+  CHECK(result.data == transpose_distribute(vec{1,2}, vec{vec{1,2}, vec{1,2}, vec{1,2}, vec{1,2}},
+                                            std::plus<int>()).data);
+
+  generator_options opt;
+  opt.leaves = 300;
+  opt.max_fan_out = 5;
+  bool same {true};
+  for (std::uint64_t seed{0}; seed < 20; ++seed) {
+    opt.seed = 2*seed;
+    Raw_Sequence x = generate(opt);
+    opt.seed = 2*seed + 1;
+    Raw_Sequence y = generate(opt);
+    same = same && transpose_distribute_unique(x, y, std::minus<int>()).data
+                   == transpose_distribute(x, y, std::minus<int>()).data;
+  }
+  CHECK(same);
+}
+
+TEST_CASE("out of core") {
+  generator_options opt;
+  opt.leaves = 200;
+  opt.max_fan_out = 5;
+  Raw_Sequence a = generate(opt);
+  opt.seed = 1;
+  Raw_Sequence b = generate(opt);
+  auto lengths = get_lengths({a,b});
+  std::vector<int> out;
+  std::size_t calls {0};
+  auto sink = [&](const int* data, std::size_t n) {
+    out.insert(out.end(), data, data + n);
+    ++calls;
+  };
+
+  SUBCASE("same as in memory") {
+    out_of_core::normalise(a, lengths, sink, 1000);
+    CHECK(out == normalise(a, lengths).data);
+    CHECK(calls == (out.size() + 999) / 1000);
+
+    out.clear();
+    out_of_core::transpose_distribute(a, b, std::minus<int>(), lengths, sink, 7);
+    CHECK(out == transpose_distribute(a, b, std::minus<int>()).data);
+
+    Sequence s ({1,2,3,4,5,6}, {2,3});
+    out.clear();
+    out_of_core::normalise(s, {2,2,3}, sink, 4);
+    CHECK(out == normalise(s, {2,2,3}).data);
+    out.clear();
+    out_of_core::transpose_distribute(s, Sequence({10,20}, {2,1}), std::plus<int>(),
+                                      {2,3}, sink);
+    CHECK(out == std::vector{11,12,13,24,25,26});
+    CHECK_THROWS_AS(out_of_core::normalise(s, {2,2}, sink), std::invalid_argument);
+    CHECK_THROWS_AS(out_of_core::normalise(a, {2}, sink), std::invalid_argument);
+  }
+
+  SUBCASE("chunks") {
+    auto chunks = out_of_core::transpose_distribute_chunks(a, b, std::plus<int>(), lengths, 100);
+    CHECK(chunks.size() == normalise(a, lengths).data.size());
+    std::uint64_t first {0};
+    bool indices {true};
+    for (const auto& c : chunks) {
+      indices = indices && c.first == first && c.size <= 100;
+      // The first element of the chunk at its index
+      std::uint64_t i {0};
+      for (std::size_t order{0}; order < lengths.size(); ++order)
+        i = i * lengths[order] + c.index[order];
+      indices = indices && i == c.first;
+      out.insert(out.end(), c.data, c.data + c.size);
+      first += c.size;
+    }
+    CHECK(indices);
+    CHECK(out == transpose_distribute(a, b, std::plus<int>()).data);
+    CHECK_FALSE(chunks.next());
+
+    Sequence s ({1,2,3,4,5,6}, {2,3});
+    auto n = out_of_core::normalised_chunks(s, {2,2,3}, 5);
+    REQUIRE(n.next());
+    CHECK(n.current().size == 5);
+    CHECK(std::vector<int>(n.current().data, n.current().data + 5) == std::vector{1,2,3,4,5});
+    REQUIRE(n.next());
+    CHECK(n.current().index == std::vector{0,1,2});
+    CHECK(n.current().data[0] == 6);
+  }
+
+  SUBCASE("file") {
+    const auto path = (std::filesystem::temp_directory_path() / "ntd_out_of_core.seq").string();
+    {
+      sequence_file_writer file (path, lengths);
+      out_of_core::transpose_distribute(a, b, std::plus<int>(), lengths, file, 64);
+      file.close();
+    }
+    auto result = load(path);
+    auto e = transpose_distribute(a, b, std::plus<int>());
+    CHECK(result.lengths == e.lengths);
+    CHECK(std::vector<int>(result.data.begin(), result.data.end()) == e.data);
+
+    sequence_file_writer file (path, {2,2});
+    file(e.data.data(), 3);
+    CHECK_THROWS_AS(file(e.data.data(), 2), std::runtime_error);
+    CHECK_THROWS_AS(file.close(), std::runtime_error);
+    std::filesystem::remove(path);
+  }
+}
+
+TEST_CASE("denormalise") {
+  Sequence a {{1,2,3,4,5,6}, {2,3}};
+
+  SUBCASE("to Raw_Sequence") {
+    auto r = denormalise(a);
+    CHECK(get_lengths(r) == a.lengths);
+    CHECK(flatten(r).data == a.data);
+    CHECK(flatten(r).nodes == std::vector<int>{2,3,-1,-1,-1,3,-1,-1,-1});
+  }
+
+  SUBCASE("round trip through normalise") {
+    Raw_Sequence b = vec{ vec{2,7,8}, vec{4,8} };
+    auto norm_b = normalise(b, {2,3});
+    CHECK(normalise(denormalise(norm_b), norm_b.lengths).data == norm_b.data);
+  }
+
+  SUBCASE("to nested vectors") {
+    auto v = denormalise<2>(a);
+    CHECK(v == std::vector<std::vector<int>>{ {1,2,3}, {4,5,6} });
+    CHECK(denormalise<1>(Sequence{{7,8}, {2}}) == std::vector{7,8});
+    CHECK_THROWS_AS(denormalise<3>(a), std::invalid_argument);
+  }
+
+  SUBCASE("nested view") {
+    nested_view v (a);
+    CHECK(v.size() == 2);
+    CHECK(v[1].size() == 3);
+    CHECK(v[1][2].is_number());
+    CHECK(v[1][2].value() == 6);
+    CHECK(v[1].begin() == a.data.data() + 3);
+    CHECK(std::vector<int>(v[0].begin(), v[0].end()) == std::vector{1,2,3});
+  }
+}
+
+TEST_CASE("generating") {
+  generator_options opt;
+  opt.seed = 42;
+  opt.leaves = 20000;
+  opt.depth = 3;
+  opt.number_chance = {0.0, 0.3, 0.5};
+
+  SUBCASE("reproducible") {
+    auto a = generate_ragged(opt, 1);
+    auto b = generate_ragged(opt, 4);
+    CHECK(a.data.size() >= opt.leaves);
+    CHECK(a.data == b.data);
+    CHECK(a.nodes == b.nodes);
+    opt.seed = 43;
+    CHECK(generate_ragged(opt).data != a.data);
+  }
+
+  SUBCASE("shape") {
+    opt.fan_out_weights = {0, 1, 0, 3};
+    auto a = generate(opt);
+    auto lengths = get_lengths(a);
+    CHECK(lengths.size() <= 4);
+    CHECK(lengths.at(1) == 4);
+    CHECK(flatten(a).data == generate_ragged(opt).data);
+    auto nodes = generate_ragged(opt).nodes;
+    CHECK(std::all_of(nodes.begin() + 1, nodes.end(),
+                      [](int n) { return n == -1 || n == 2 || n == 4; }));
+  }
+
+  SUBCASE("to file") {
+    const auto path = (std::filesystem::temp_directory_path() / "ntd_test.txt").string();
+    opt.leaves = 5000;
+    generate_file(opt, path);
+    auto r = parse_ragged_file(path);
+    CHECK(r.nodes == generate_ragged(opt).nodes);
+    CHECK(r.data == generate_ragged(opt).data);
+    std::filesystem::remove(path);
+  }
+}
+
+TEST_CASE("counters") {
+  counters::reset();
+  Raw_Sequence a = vec{2,3,vec{7,8},4};
+  Raw_Sequence b = 10;
+  auto result = transpose_distribute(a, b, std::multiplies<int>());
+  auto c = counters::snapshot();
+
+#ifdef NTD_COUNTERS
+  CHECK(c.nodes_visited > 0);
+  CHECK(c.elements_computed == 8);
+  CHECK(c.elements_repeated > 0);
+  CHECK(c.calls[counters::get_lengths] == 1);
+  CHECK(c.calls[counters::normalise_raw] == 2);
+  CHECK(c.calls[counters::transform] == 1);
+  counters::reset();
+  CHECK(counters::snapshot().nodes_visited == 0);
+#else
+  CHECK(c.nodes_visited == 0);
+  CHECK(c.calls[counters::transform] == 0);
+#endif
+}
+
+TEST_CASE("tracing") {
+  trace::global().clear();
+  Raw_Sequence a = vec{2,3,vec{7,8},4};
+  Raw_Sequence b = 10;
+  std::thread worker([&] { transpose_distribute(a, b, std::plus<int>()); });
+  worker.join();
+  transpose_distribute(a, b, std::plus<int>());
+
+  std::ostringstream os;
+  trace::global().write(os);
+#ifdef NTD_TRACE
+  // Per call: transpose_distribute, get_lengths of the list, normalise
+  // of each operand and transform
+  CHECK(trace::global().size() == 10);
+  CHECK(os.str().find("\"name\": \"normalise\"") != std::string::npos);
+  CHECK(os.str().find("\"output\": 8") != std::string::npos);
+#else
+  CHECK(trace::global().size() == 0);
+#endif
+  CHECK(os.str().rfind("{\"traceEvents\": [", 0) == 0);
+}
+
+TEST_CASE("capture and replay") {
+  const auto path = (std::filesystem::temp_directory_path() / "ntd_test.ntdc").string();
+  Raw_Sequence a = vec{ vec{2,7,8}, vec{4,8} };
+  Raw_Sequence b = 6;
+  Sequence c {{1,2,3,4}, {2,2}};
+
+  for (bool with_data : {false, true}) {
+    capture::start(path, with_data);
+    auto r1 = transpose_distribute(a, b, std::plus<int>());
+    auto r2 = normalise(c, {3,2});
+    capture::stop();
+
+#ifdef NTD_CAPTURE
+    auto calls = capture::read_log(path);
+    REQUIRE(calls.size() == 2);
+    CHECK(calls[0].kind == capture::transpose_distribute_raw);
+    CHECK(flatten(calls[0].operands[0].raw).nodes == flatten(a).nodes);
+    CHECK(calls[1].kind == capture::normalise_sequence);
+    CHECK(calls[1].operands[0].sequence.lengths == c.lengths);
+    CHECK(calls[1].operands[1].lengths == std::vector<int>{3,2});
+    CHECK(capture::replay(calls[0]) == r1.data.size());
+    CHECK(capture::replay(calls[1]) == r2.data.size());
+    if (with_data) {
+      CHECK(flatten(calls[0].operands[0].raw).data == flatten(a).data);
+      CHECK(calls[1].operands[0].sequence.data == c.data);
+    }
+#else
+    CHECK(capture::read_log(path).empty());
+#endif
+  }
+
+  // Logs that claim more than they hold
+  auto log = [&](std::initializer_list<std::uint64_t> varints) {
+    std::string out (capture::magic, 4);
+    out.append(reinterpret_cast<const char*>(&capture::version), sizeof capture::version);
+    for (auto x : varints) archive::put_varint(out, x);
+    std::ofstream(path, std::ios::binary) << out;
+  };
+  log({capture::normalise_raw, std::uint64_t(1) << 40});
+  CHECK_THROWS_AS(capture::read_log(path), std::runtime_error);
+  log({capture::normalise_raw, 1, capture::raw_operand, std::uint64_t(1) << 40});
+  CHECK_THROWS_AS(capture::read_log(path), std::runtime_error);
+  // A vector of 2^30 children, with no more nodes
+  log({capture::normalise_raw, 1, capture::raw_operand, 1, archive::zigzag(1 << 30), 0, 0});
+  CHECK_THROWS_AS(capture::read_log(path), std::runtime_error);
+  // Sizes that do not match the lengths, or the numbers left
+  log({capture::normalise_sequence, 1, capture::sequence_operand, 1, 4, std::uint64_t(1) << 40, 0});
+  CHECK_THROWS_AS(capture::read_log(path), std::runtime_error);
+  log({capture::normalise_raw, 1, capture::raw_operand, 2, 2, 1, 2, 1});
+  CHECK_THROWS_AS(capture::read_log(path), std::runtime_error);
+  std::filesystem::remove(path);
+
+  capture::captured_call call;
+  call.kind = capture::normalise_raw;
+  call.operands.resize(2);
+  call.operands[0].kind = capture::sequence_operand;
+  call.operands[1].kind = capture::lengths_operand;
+  CHECK_THROWS_AS(capture::replay(call), std::runtime_error);
+  call.operands[0].kind = capture::raw_operand;
+  call.operands[0].raw = vec{1,2};
+  call.operands[1].lengths = {2};
+  CHECK(capture::replay(call) == 2);
+  call.operands.pop_back();
+  CHECK_THROWS_AS(capture::replay(call), std::runtime_error);
+}
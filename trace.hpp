@@ -0,0 +1,137 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "constexpr.hpp"
+
+// Spans of the NTD stages in Chrome trace event format, for loading
+// into chrome://tracing or Perfetto.
+//
+// Tracing is switched on by compiling with -DNTD_TRACE. Without it
+// NTD_SPAN and NTD_SPAN_ARG expand to nothing and their arguments are
+// never evaluated. Spans can be recorded from any thread, each thread
+// shows up as its own track.
+namespace trace {
+  using clock = std::chrono::steady_clock;
+
+  struct event {
+    const char* name;
+    clock::time_point start;
+    clock::duration duration;
+    std::uint32_t thread;
+    int n_args;
+    const char* keys[4];
+    long long values[4];
+  };
+
+  class tracer {
+    std::mutex m;
+    std::vector<event> events;
+    const clock::time_point origin {clock::now()};
+  public:
+    void record(const event& e) {
+      std::lock_guard<std::mutex> lock(m);
+      events.push_back(e);
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(m);
+      events.clear();
+    }
+
+    std::size_t size() {
+      std::lock_guard<std::mutex> lock(m);
+      return events.size();
+    }
+
+    void write(std::ostream& os) {
+      using us = std::chrono::duration<double, std::micro>;
+      std::lock_guard<std::mutex> lock(m);
+      os << "{\"traceEvents\": [";
+      for (std::size_t i{0}; i < events.size(); ++i) {
+        const auto& e = events[i];
+        os << (i ? ",\n" : "\n")
+           << "  {\"name\": \"" << e.name << "\", \"cat\": \"ntd\", \"ph\": \"X\""
+           << ", \"ts\": " << us(e.start - origin).count()
+           << ", \"dur\": " << us(e.duration).count()
+           << ", \"pid\": 1, \"tid\": " << e.thread
+           << ", \"args\": {";
+        for (int a{0}; a < e.n_args; ++a)
+          os << (a ? ", " : "") << "\"" << e.keys[a] << "\": " << e.values[a];
+        os << "}}";
+      }
+      os << "\n], \"displayTimeUnit\": \"ns\"}\n";
+    }
+
+    void write(const std::string& path) {
+      std::ofstream out(path, std::ios::trunc);
+      if (!out) throw std::runtime_error(path + ": cannot open for writing");
+      write(out);
+    }
+  };
+
+  inline tracer& global() {
+    static tracer t;
+    return t;
+  }
+
+  // Small sequential id of the calling thread
+  inline std::uint32_t thread_id() {
+    static std::atomic<std::uint32_t> next {1};
+    thread_local std::uint32_t id = next++;
+    return id;
+  }
+
+  // Records one complete event from construction to destruction.
+  // Nothing is recorded during constant evaluation.
+  class span {
+    event e;
+
+    // Make sure the trace origin is set before the span starts
+    static clock::time_point start() {
+      global();
+      return clock::now();
+    }
+  public:
+    constexpr explicit span(const char* name)
+      : e{name, {}, {}, 0, 0, {}, {}} {
+      if (__builtin_is_constant_evaluated()) return;
+      e.thread = thread_id();
+      e.start = start();
+    }
+    span(const span&) = delete;
+    NTD_CONSTEXPR ~span() {
+#if __cpp_constexpr_dynamic_alloc >= 201907L
+      if (__builtin_is_constant_evaluated()) return;
+#endif
+      e.duration = clock::now() - e.start;
+      global().record(e);
+    }
+
+    // Attach a named value, at most four per span
+    constexpr void arg(const char* key, long long value) {
+      if (e.n_args == 4) return;
+      e.keys[e.n_args] = key;
+      e.values[e.n_args++] = value;
+    }
+  };
+}
+
+#ifdef NTD_TRACE
+#define NTD_SPAN(var, name) trace::span var {name}
+#define NTD_SPAN_ARG(var, key, value) \
+  (__builtin_is_constant_evaluated() ? void() : var.arg(key, (value)))
+#else
+#define NTD_SPAN(var, name) ((void)0)
+#define NTD_SPAN_ARG(var, key, value) ((void)0)
+#endif
+
+#endif